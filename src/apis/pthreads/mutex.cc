@@ -20,6 +20,7 @@ public:
 	{
 		Semaphore *sem = lookupSemOnStop();
 
+		IController::getInstance().onLock(curThread, sem);
 		sem->wait();
 
 		return true;
@@ -33,6 +34,7 @@ public:
 	{
 		Semaphore *sem = lookupSemOnStop();
 
+		IController::getInstance().onUnlock(curThread, sem);
 		sem->signal();
 
 		return true;
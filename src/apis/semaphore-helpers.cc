@@ -29,16 +29,37 @@ void SemaphoreManager::clearSemaphores()
 	m_semaphores.clear();
 }
 
+bool SemaphoreManager::isIdle()
+{
+	for (SemaphoreManager::SemaphoreMap_t::iterator it = m_semaphores.begin();
+			it != m_semaphores.end(); it++) {
+		if (!it->second->isIdle())
+			return false;
+	}
+
+	return true;
+}
+
+static SemaphoreManager *curInstance;
+
 SemaphoreManager &SemaphoreManager::getInstance()
 {
 	static SemaphoreManager *instance;
 
+	if (curInstance)
+		return *curInstance;
+
 	if (!instance)
 		instance = new SemaphoreManager();
 
 	return *instance;
 }
 
+void SemaphoreManager::setInstance(SemaphoreManager *instance)
+{
+	curInstance = instance;
+}
+
 
 
 Semaphore *SemaphoreBase::lookupSemOnStop()
@@ -6,7 +6,7 @@
 using namespace coincident;
 
 Semaphore::Semaphore(int maxValue, int startValue) :
-	m_maxValue(maxValue), m_value(startValue)
+	m_maxValue(maxValue), m_value(startValue), m_startValue(startValue)
 {
 	panic_if (m_value > m_maxValue,
 			"Illegal start values: %d and max %d\n",
@@ -19,12 +19,18 @@ void Semaphore::signal()
 	if (m_value == m_maxValue)
 		return;
 
+	IController &controller = IController::getInstance();
+
+	controller.onRelease(controller.getCurrentThread(), this);
+
 	if (m_value == 0 && !m_waitList.empty()) {
 		IThread *waiter = m_waitList.front();
 
-		waiter->unBlock();
+		// The waiter gets the semaphore from this signal
+		controller.onAcquire(waiter, this);
+		controller.unBlockThread(waiter);
 		m_waitList.pop_front();
-		IController::getInstance().forceReschedule();
+		controller.forceReschedule();
 	}
 
 	m_value++;
@@ -32,20 +38,26 @@ void Semaphore::signal()
 
 void Semaphore::wait()
 {
+	IController &controller = IController::getInstance();
+	IThread *cur = controller.getCurrentThread();
+
 	if (m_value > 0) {
 		m_value--;
+		controller.onAcquire(cur, this);
 		return;
 	}
 
 	// m_value is 0 - block this thread!
-	IController &controller = IController::getInstance();
-	IThread *cur = controller.getCurrentThread();
-
-	cur->block();
+	controller.blockThread(cur);
 	m_waitList.push_back(cur);
 	controller.forceReschedule();
 }
 
+bool Semaphore::isIdle()
+{
+	return m_value == m_startValue && m_waitList.empty();
+}
+
 bool Semaphore::tryWait()
 {
 	if (m_value == 0)
@@ -0,0 +1,219 @@
+#include <detector.hh>
+#include <shadow-memory.hh>
+#include <utils.hh>
+
+#include <stdio.h>
+#include <map>
+#include <string>
+
+using namespace coincident;
+
+// Threads kept per word, the one which accessed it least recently goes
+#define ATOMICITY_THREADS_PER_WORD 4
+
+/*
+ * AVIO-style atomicity violation detector. For each word and thread, the
+ * last local access is kept together with the last access by another
+ * thread after it. The next local access then completes a triple, which is
+ * reported if no serial order of the local pair and the remote access
+ * gives the same result:
+ *
+ *   local   remote   local
+ *   read    write    read     the two reads see different values
+ *   write   write    read     the local write is lost to the read
+ *   write   read     write    the remote read sees a partial update
+ *   read    write    write    the remote write is lost
+ *
+ * The history is in shadow pages, with a fixed number of threads per
+ * word, so it is bounded by the memory the program touches.
+ */
+class Atomicity : public IDetector
+{
+public:
+	Atomicity()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		m_threadIds.clear();
+		m_shadow.clear();
+		m_report.clear();
+		m_preempt = false;
+	}
+
+	bool onAccess(IThread *thread, void *site,
+			void *addr, size_t size, bool isStore)
+	{
+		int tid = getThreadId(thread);
+
+		m_preempt = false;
+		for_each_word(word, addr, size) {
+			ShadowWord &shadow = m_shadow.lookup(word);
+			LocalAccess &local = lookupLocal(shadow, tid);
+			bool race = false;
+
+			if (local.site && local.remoteSite &&
+					isUnserializable(local.isStore, local.remoteIsStore, isStore))
+				race = reportViolation(word, local, tid, site, isStore);
+
+			// This access interleaves the pairs of the other threads
+			for (int i = 1; i < ATOMICITY_THREADS_PER_WORD; i++) {
+				LocalAccess &other = shadow.threads[i];
+
+				if (!other.site)
+					continue;
+
+				other.remoteSite = site;
+				other.remoteIsStore = isStore;
+				other.remoteTid = tid;
+				m_preempt = true;
+			}
+
+			local.site = site;
+			local.isStore = isStore;
+			local.remoteSite = NULL;
+
+			if (race)
+				return true;
+		}
+
+		return false;
+	}
+
+	// The violations are in the access order alone, synchronization doesn't matter
+	void onAcquire(IThread *thread, const void *object)
+	{
+	}
+
+	void onRelease(IThread *thread, const void *object)
+	{
+	}
+
+	// Neither do the locks, a locked pair can still be interleaved by an unlocked access
+	void onLock(IThread *thread, const void *lock)
+	{
+	}
+
+	void onUnlock(IThread *thread, const void *lock)
+	{
+	}
+
+	// Another thread has used the word, so it could interleave here
+	bool wantsPreemption()
+	{
+		return m_preempt;
+	}
+
+	const char *getReport()
+	{
+		return m_report.c_str();
+	}
+
+private:
+	// The last access of a thread, and the last remote one since then
+	class LocalAccess
+	{
+	public:
+		void *site; // NULL for an unused entry
+		void *remoteSite; // NULL if there was none
+		int tid;
+		int remoteTid;
+		bool isStore;
+		bool remoteIsStore;
+	};
+
+	// Most recently accessing thread first
+	class ShadowWord
+	{
+	public:
+		LocalAccess threads[ATOMICITY_THREADS_PER_WORD];
+	};
+
+	typedef std::map<IThread *, int> ThreadIdMap_t;
+
+	// Move the entry of tid first, replacing the last one if it has none
+	static LocalAccess &lookupLocal(ShadowWord &shadow, int tid)
+	{
+		int i;
+
+		for (i = 0; i < ATOMICITY_THREADS_PER_WORD - 1; i++) {
+			if (shadow.threads[i].site && shadow.threads[i].tid == tid)
+				break;
+		}
+
+		LocalAccess cur = shadow.threads[i];
+
+		if (!cur.site || cur.tid != tid) {
+			cur.site = NULL;
+			cur.remoteSite = NULL;
+			cur.tid = tid;
+		}
+
+		for (; i > 0; i--)
+			shadow.threads[i] = shadow.threads[i - 1];
+		shadow.threads[0] = cur;
+
+		return shadow.threads[0];
+	}
+
+	int getThreadId(IThread *thread)
+	{
+		ThreadIdMap_t::iterator it = m_threadIds.find(thread);
+
+		if (it != m_threadIds.end())
+			return it->second;
+
+		int tid = m_threadIds.size();
+
+		m_threadIds[thread] = tid;
+
+		return tid;
+	}
+
+	static bool isUnserializable(bool first, bool remote, bool second)
+	{
+		// Indexed by first, remote, second, with stores as 1
+		static const bool table[8] =
+		{
+			false, // R R R
+			false, // R R W
+			true,  // R W R
+			true,  // R W W
+			false, // W R R
+			true,  // W R W
+			true,  // W W R
+			false, // W W W
+		};
+
+		return table[(first << 2) | (remote << 1) | second];
+	}
+
+	bool reportViolation(unsigned long addr, const LocalAccess &local, int tid,
+			void *site, bool isStore)
+	{
+		char buf[256];
+
+		snprintf(buf, sizeof(buf),
+				"Atomicity violation on 0x%08lx: %s at %p and %s at %p (thread %d) are interleaved by %s at %p (thread %d)",
+				addr,
+				local.isStore ? "write" : "read", local.site,
+				isStore ? "write" : "read", site, tid,
+				local.remoteIsStore ? "write" : "read", local.remoteSite,
+				local.remoteTid);
+		m_report = buf;
+
+		return true;
+	}
+
+	ThreadIdMap_t m_threadIds;
+	ShadowMemory<ShadowWord> m_shadow;
+	bool m_preempt;
+	std::string m_report;
+};
+
+IDetector *IDetector::createAtomicity()
+{
+	return new Atomicity();
+}
@@ -0,0 +1,148 @@
+#include <breakpoint-table.hh>
+#include <utils.hh>
+
+#include <algorithm>
+
+using namespace coincident;
+
+// Keep the load factor below 1/2 for short probe sequences
+#define MIN_CAPACITY 64
+
+BreakpointTable::BreakpointTable()
+{
+	m_used = 0;
+	resize(MIN_CAPACITY);
+}
+
+int BreakpointTable::insert(void *addr, uint8_t instruction)
+{
+	Slot slot;
+
+	panic_if(addr == NULL,
+			"Can't set a breakpoint on NULL");
+	panic_if(lookup(addr),
+			"Breakpoint at %p already in the table", addr);
+
+	if ((m_used + 1) * 2 > m_slots.size())
+		resize(m_slots.size() * 2);
+
+	slot.addr = (unsigned long)addr;
+	slot.id = m_addresses.size();
+	slot.instruction = instruction;
+	slot.hardware = false;
+
+	m_addresses.push_back(addr);
+	insertSlot(slot);
+	m_used++;
+
+	return slot.id;
+}
+
+bool BreakpointTable::erase(int id)
+{
+	void *addr = getAddress(id);
+
+	if (!addr)
+		return false;
+
+	unsigned int i = hash((unsigned long)addr);
+
+	while (m_slots[i].addr != (unsigned long)addr)
+		i = (i + 1) & m_mask;
+
+	/*
+	 * Backward-shift deletion: move later entries of the probe sequence
+	 * into the hole so that lookups never need tombstones.
+	 */
+	unsigned int hole = i;
+
+	while (1) {
+		i = (i + 1) & m_mask;
+
+		if (m_slots[i].addr == 0)
+			break;
+
+		unsigned int home = hash(m_slots[i].addr);
+
+		// Can the entry at i be moved back to the hole?
+		if (((i - home) & m_mask) >= ((i - hole) & m_mask)) {
+			m_slots[hole] = m_slots[i];
+			hole = i;
+		}
+	}
+	m_slots[hole].addr = 0;
+
+	m_addresses[id] = NULL;
+	m_used--;
+
+	return true;
+}
+
+void BreakpointTable::clear()
+{
+	m_addresses.clear();
+	m_slots.clear();
+	m_used = 0;
+
+	resize(MIN_CAPACITY);
+}
+
+void BreakpointTable::swap(BreakpointTable &other)
+{
+	m_addresses.swap(other.m_addresses);
+	m_slots.swap(other.m_slots);
+	std::swap(m_mask, other.m_mask);
+	std::swap(m_shift, other.m_shift);
+	std::swap(m_used, other.m_used);
+}
+
+void BreakpointTable::setHardware(int id, bool hardware)
+{
+	void *addr = getAddress(id);
+
+	if (!addr)
+		return;
+
+	unsigned int i = hash((unsigned long)addr);
+
+	while (m_slots[i].addr != (unsigned long)addr)
+		i = (i + 1) & m_mask;
+
+	m_slots[i].hardware = hardware;
+}
+
+void BreakpointTable::resize(unsigned int capacity)
+{
+	std::vector<Slot> old;
+	Slot empty;
+
+	empty.addr = 0;
+	empty.id = -1;
+	empty.instruction = 0;
+	empty.hardware = false;
+
+	old.swap(m_slots);
+	m_slots.assign(capacity, empty);
+	m_mask = capacity - 1;
+
+	m_shift = 32;
+	while (capacity > 1) {
+		capacity >>= 1;
+		m_shift--;
+	}
+
+	for (unsigned int i = 0; i < old.size(); i++) {
+		if (old[i].addr != 0)
+			insertSlot(old[i]);
+	}
+}
+
+void BreakpointTable::insertSlot(const Slot &slot)
+{
+	unsigned int i = hash(slot.addr);
+
+	while (m_slots[i].addr != 0)
+		i = (i + 1) & m_mask;
+
+	m_slots[i] = slot;
+}
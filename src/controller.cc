@@ -7,19 +7,60 @@
 #include <elf.hh>
 #include <stdarg.h>
 #include <function.hh>
+#include <detector.hh>
+#include <coincident/api-helpers/semaphore-helpers.hh>
 
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <map>
+#include <set>
+#include <list>
+#include <vector>
 #include <string>
+#include <algorithm>
 
 using namespace coincident;
 
-#define N_THREADS 16
+
+// How often to look for store sites to move to debug registers
+#define HW_PROMOTE_INTERVAL 1024
+// ... and how many hits a site needs to be considered
+#define HW_PROMOTE_MIN_HITS 16
+
+// Scheduling decisions between checkpoints
+#define CHECKPOINT_INTERVAL 64
+
+#define BITS_PER_WORD (sizeof(unsigned long) * 8)
+
+// Events assumed for the first PCT run, before there is an estimate
+#define PCT_DEFAULT_EVENTS 1000
+
+// Accesses by other threads before a parked thread is let go
+#define RACE_FUZZER_PARK_EVENTS 1000
+
+// Index of the n:th set bit in a bitmap
+static int nthSetBit(const unsigned long *bits, int n)
+{
+	for (int word = 0; ; word++) {
+		unsigned long cur = bits[word];
+		int count = __builtin_popcountl(cur);
+
+		if (n >= count) {
+			n -= count;
+			continue;
+		}
+
+		while (n-- > 0)
+			cur &= cur - 1;
+
+		return word * BITS_PER_WORD + __builtin_ctzl(cur);
+	}
+}
 
 class DefaultThreadSelector : public IController::IThreadSelector
 {
@@ -32,6 +73,20 @@ public:
 	{
 		return rand() % nThreads;
 	}
+
+	int selectRunnable(int curThread,
+			IThread **threads,
+			int nThreads,
+			const unsigned long *runnable,
+			int nRunnable,
+			uint64_t timeUs,
+			const PtraceEvent *ev)
+	{
+		if (nRunnable == 0)
+			return curThread;
+
+		return nthSetBit(runnable, rand() % nRunnable);
+	}
 };
 
 class TimeListSelector : public IController::IThreadSelector
@@ -87,6 +142,377 @@ private:
 	int m_curBucket;
 };
 
+/*
+ * RaceFuzzer-style selector. The first runs are random, and collect pairs
+ * of sites where different threads access the same word, with at least one
+ * write. Each following run targets one pair in one order: a thread which
+ * reaches the first site is parked before the access, until another thread
+ * is about to access the same word from the partner site. Either the
+ * parked or the arriving thread then goes first, and the next run tries
+ * the other order.
+ */
+class RaceFuzzerSelector : public IController::IThreadSelector
+{
+public:
+	RaceFuzzerSelector(int collectRuns) :
+		m_collectRuns(collectRuns), m_run(0), m_target(0),
+		m_parked(NULL), m_parkedWord(0), m_parkedEvents(0), m_next(NULL)
+	{
+	}
+
+	int selectThread(int curThread,
+			IThread **threads,
+			int nThreads,
+			uint64_t timeUs,
+			const PtraceEvent *ev)
+	{
+		return rand() % nThreads;
+	}
+
+	int selectRunnable(int curThread,
+			IThread **threads,
+			int nThreads,
+			const unsigned long *runnable,
+			int nRunnable,
+			uint64_t timeUs,
+			const PtraceEvent *ev)
+	{
+		// Run the thread which goes first in a resolved race
+		if (m_next) {
+			int which = indexOf(m_next, threads, nThreads);
+
+			m_next = NULL;
+			if (which >= 0 && (runnable[which / BITS_PER_WORD] & (1UL << (which % BITS_PER_WORD))))
+				return which;
+		}
+
+		// Everything else is blocked, so the partner won't come
+		if (nRunnable == 0 && m_parked) {
+			int which = indexOf(m_parked, threads, nThreads);
+
+			release();
+
+			return which >= 0 ? which : curThread;
+		}
+
+		if (nRunnable == 0)
+			return curThread;
+
+		return nthSetBit(runnable, rand() % nRunnable);
+	}
+
+	bool wantsAccesses()
+	{
+		return true;
+	}
+
+	// The pairs are collected in the first runs, and targeted one per run
+	bool needsSerialRuns()
+	{
+		return true;
+	}
+
+	void onRunStart(IThread **threads, int nThreads)
+	{
+		m_run++;
+		m_accesses.clear();
+		m_passThrough.clear();
+		m_parked = NULL;
+		m_next = NULL;
+
+		if (m_run <= m_collectRuns)
+			return;
+
+		// Done collecting, try both orders of each pair
+		if (m_targets.empty()) {
+			for (SitePairSet_t::iterator it = m_candidates.begin();
+					it != m_candidates.end();
+					it++) {
+				m_targets.push_back(Target(it->first, it->second, true));
+				m_targets.push_back(Target(it->first, it->second, false));
+			}
+			coin_debug(INFO_MSG, "INFO: %u candidate race pairs\n",
+					(unsigned int)m_candidates.size());
+		}
+		m_target = m_run - m_collectRuns - 1;
+	}
+
+	bool onAccess(IThread *thread, void *site,
+			void *addr, size_t size, bool isStore)
+	{
+		unsigned long word = coin_word((unsigned long)addr);
+
+		// The retrap of a postponed access
+		if (m_passThrough.erase(thread))
+			return false;
+
+		if (m_run <= m_collectRuns) {
+			collect(thread, site, word, isStore);
+			return false;
+		}
+
+		if (m_target >= m_targets.size())
+			return false;
+
+		const Target &target = m_targets[m_target];
+
+		if (!m_parked) {
+			if (site != target.first)
+				return false;
+
+			IController::getInstance().blockThread(thread);
+			m_parked = thread;
+			m_parkedWord = word;
+			m_parkedEvents = 0;
+
+			return true;
+		}
+
+		if (thread == m_parked || site != target.second || word != m_parkedWord) {
+			if (++m_parkedEvents > RACE_FUZZER_PARK_EVENTS)
+				release();
+			return false;
+		}
+
+		coin_debug(INFO_MSG, "INFO: Race between %p and %p on 0x%08lx, %s first\n",
+				target.first, target.second, word,
+				target.parkedFirst ? "parked" : "arriving");
+
+		m_next = m_parked;
+		release();
+		if (!target.parkedFirst)
+			return false;
+
+		// Switched out now, and goes after the parked thread
+		m_passThrough.insert(thread);
+
+		return true;
+	}
+
+private:
+	class Target
+	{
+	public:
+		Target(void *a, void *b, bool order) :
+			first(a), second(b), parkedFirst(order)
+		{
+		}
+
+		void *first;
+		void *second;
+		bool parkedFirst;
+	};
+
+	class Access
+	{
+	public:
+		IThread *thread;
+		void *site;
+		bool isStore;
+	};
+
+	typedef std::set<std::pair<void *, void *> > SitePairSet_t;
+	typedef std::map<unsigned long, std::vector<Access> > AccessMap_t;
+
+	static int indexOf(IThread *thread, IThread **threads, int nThreads)
+	{
+		for (int i = 0; i < nThreads; i++) {
+			if (threads[i] == thread)
+				return i;
+		}
+
+		return -1;
+	}
+
+	// Keep the last access of each thread to each word
+	void collect(IThread *thread, void *site, unsigned long word, bool isStore)
+	{
+		std::vector<Access> &accesses = m_accesses[word];
+		bool found = false;
+
+		for (unsigned int i = 0; i < accesses.size(); i++) {
+			Access &cur = accesses[i];
+
+			if (cur.thread == thread) {
+				cur.site = site;
+				cur.isStore = isStore;
+				found = true;
+				continue;
+			}
+
+			if (cur.isStore || isStore)
+				m_candidates.insert(std::make_pair(std::min(site, cur.site),
+						std::max(site, cur.site)));
+		}
+
+		if (found)
+			return;
+
+		Access cur;
+
+		cur.thread = thread;
+		cur.site = site;
+		cur.isStore = isStore;
+		accesses.push_back(cur);
+	}
+
+	// The parked thread goes on, and passes the breakpoint it stopped at
+	void release()
+	{
+		IController::getInstance().unBlockThread(m_parked);
+		m_passThrough.insert(m_parked);
+		m_parked = NULL;
+	}
+
+	int m_collectRuns;
+	int m_run;
+	unsigned int m_target;
+
+	SitePairSet_t m_candidates;
+	std::vector<Target> m_targets;
+
+	// For this run
+	AccessMap_t m_accesses;
+	std::set<IThread *> m_passThrough;
+	IThread *m_parked;
+	unsigned long m_parkedWord;
+	unsigned int m_parkedEvents;
+	IThread *m_next;
+};
+
+/*
+ * PCT (probabilistic concurrency testing): the threads get random
+ * priorities when a run starts, and the highest priority runnable thread
+ * always runs. At d - 1 random events, the priority of the running thread
+ * is lowered below all others. A bug of depth d is then found with a
+ * probability of at least 1 / (n * k^(d-1)) per run, for n threads and k
+ * events. k is estimated from the number of events in the previous run.
+ */
+class PctSelector : public IController::IThreadSelector
+{
+public:
+	PctSelector(int depth) : m_depth(depth), m_events(0)
+	{
+		panic_if(depth < 1, "PCT depth must be at least 1, not %d\n", depth);
+	}
+
+	int selectThread(int curThread,
+			IThread **threads,
+			int nThreads,
+			uint64_t timeUs,
+			const PtraceEvent *ev)
+	{
+		// The initial thread of a run is selected without an event
+		if (ev)
+			countEvent(curThread >= 0 && curThread < nThreads ? threads[curThread] : NULL);
+
+		int out = curThread;
+		int best = -1;
+
+		for (int i = 0; i < nThreads; i++) {
+			int cur = m_priorities[threads[i]];
+
+			if (cur > best) {
+				best = cur;
+				out = i;
+			}
+		}
+
+		return out;
+	}
+
+	int selectRunnable(int curThread,
+			IThread **threads,
+			int nThreads,
+			const unsigned long *runnable,
+			int nRunnable,
+			uint64_t timeUs,
+			const PtraceEvent *ev)
+	{
+		countEvent(curThread < nThreads ? threads[curThread] : NULL);
+
+		int out = curThread;
+		int best = -1;
+
+		for (int i = 0; i < nThreads; i++) {
+			if (!(runnable[i / BITS_PER_WORD] & (1UL << (i % BITS_PER_WORD))))
+				continue;
+
+			int cur = m_priorities[threads[i]];
+
+			if (cur > best) {
+				best = cur;
+				out = i;
+			}
+		}
+
+		return out;
+	}
+
+	// The change points are drawn from the events of the previous run
+	bool needsSerialRuns()
+	{
+		return true;
+	}
+
+	/*
+	 * Initial priorities are a permutation of d..d+n-1, and the change
+	 * points lower the running thread to 1..d-1.
+	 */
+	void onRunStart(IThread **threads, int nThreads)
+	{
+		unsigned long estimate = m_events ? m_events : PCT_DEFAULT_EVENTS;
+		std::vector<int> priorities;
+
+		for (int i = 0; i < nThreads; i++)
+			priorities.push_back(m_depth + i);
+
+		// Fisher-Yates with rand(), so runs follow the srand() seed
+		for (int i = nThreads - 1; i > 0; i--)
+			std::swap(priorities[i], priorities[rand() % (i + 1)]);
+
+		m_priorities.clear();
+		for (int i = 0; i < nThreads; i++)
+			m_priorities[threads[i]] = priorities[i];
+
+		m_changePoints.clear();
+		for (int i = 1; i < m_depth && m_changePoints.size() < estimate; i++) {
+			unsigned long point;
+
+			// Redraw taken points, so there are d - 1 of them
+			do {
+				point = 1 + rand() % estimate;
+			} while (m_changePoints.find(point) != m_changePoints.end());
+
+			m_changePoints[point] = m_depth - i;
+		}
+
+		m_events = 0;
+	}
+
+private:
+	typedef std::map<IThread *, int> PriorityMap_t;
+
+	void countEvent(IThread *running)
+	{
+		std::map<unsigned long, int>::iterator it = m_changePoints.find(++m_events);
+
+		if (it == m_changePoints.end() || !running)
+			return;
+
+		coin_debug(INFO_MSG, "INFO: PCT change point at event %lu, priority %d\n",
+				m_events, it->second);
+		m_priorities[running] = it->second;
+	}
+
+	int m_depth;
+	// In this run, and the estimate for the next
+	unsigned long m_events;
+	PriorityMap_t m_priorities;
+	// Event number -> new priority
+	std::map<unsigned long, int> m_changePoints;
+};
+
 namespace coincident
 {
 	class Session;
@@ -108,6 +534,57 @@ public:
 		void *m_priv;
 	};
 
+	// Shared between the worker processes in parallel mode
+	class WorkerState
+	{
+	public:
+		int runsLeft;
+		int stop;
+		int failed;
+		char error[1024];
+	};
+
+	// Forwards thread exits to the session being handled
+	class ExitHandler : public IFunctionHandler
+	{
+	public:
+		ExitHandler(Controller &owner);
+
+		bool handle(IThread *cur, void *addr, const PtraceEvent &ev);
+	private:
+		Controller &m_owner;
+	};
+
+	// Where the time of the runs goes, summed over all runs
+	enum Phase
+	{
+		PHASE_SETUP = 0,  // Forking and arming before the child runs
+		PHASE_PREPARE,    // The same, but while another child runs
+		PHASE_RUN,        // From the first resume until the run is over
+		PHASE_TEARDOWN,   // Killing or restoring the child
+		N_PHASES,
+	};
+
+	// What the runs so far have seen a store or load site access
+	class StoreSiteProfile
+	{
+	public:
+		unsigned int privateRuns; // Runs where it only accessed thread-private addresses
+		bool shared; // Has accessed an address which another thread also accessed
+	};
+
+	// The store and load sites hit in a run, true for the shared ones
+	typedef std::map<void *, bool> SiteSharingMap_t;
+
+	// A stopped copy of the child at a scheduling decision
+	class Checkpoint
+	{
+	public:
+		int pid;
+		std::vector<IThread *> threads;
+		std::vector<bool> tried; // Threads selected from here so far
+	};
+
 	Controller();
 
 	virtual ~Controller();
@@ -127,12 +604,76 @@ public:
 
 	void forceReschedule();
 
+	void blockThread(IThread *thread);
+
+	void unBlockThread(IThread *thread);
+
+	void onAcquire(IThread *thread, const void *object);
+
+	void onRelease(IThread *thread, const void *object);
+
+	void onLock(IThread *thread, const void *lock);
+
+	void onUnlock(IThread *thread, const void *lock);
+
 	bool run();
 
+	bool runSessions();
+
+	bool runSerial();
+
+	bool runWorkers();
+
+	bool runConcurrentSessions();
+
+	bool runPipelined();
+
+	bool prepareSession(Session &session);
+
+	bool claimRun(int started);
+
 	void setRuns(int nRuns);
 
+	void setWorkers(int nWorkers);
+
+	void setConcurrentSessions(int nSessions);
+
+	void setPipeline(bool enabled);
+
+	uint64_t addPhaseTime(enum Phase phase, uint64_t start);
+
+	void printPhaseTimes();
+
 	void setTimeLimit(int ms);
 
+	void setForkServer(bool enabled);
+
+	void setSnapshotRestore(bool enabled);
+
+	void setCheckpoints(int maxCheckpoints);
+
+	void setStackStores(bool enabled);
+
+	void setStorePruning(int nRuns);
+
+	void updateStoreProfile(const SiteSharingMap_t &sites);
+
+	bool isPruned(void *site);
+
+	void setHappensBefore(bool enabled);
+
+	void setLockset(bool enabled);
+
+	void setAtomicity(bool enabled);
+
+	void setGuidedPreemption(bool enabled);
+
+	Checkpoint *nextCheckpoint();
+
+	void addCheckpoint(Checkpoint *cp);
+
+	void releaseCheckpoint(Checkpoint *cp);
+
 	void cleanup();
 
 	bool registerFunctionHandler(void *functionAddress,
@@ -151,15 +692,21 @@ public:
 	typedef std::map<void *, IFunctionHandler *> FunctionHandlerMap_t;
 	typedef std::map<int, IFunction *> FunctionBreakpointMap_t;
 	typedef std::map<void *, int> BreakpointMap_t;
+	typedef std::set<void *> SiteSet_t;
+	typedef std::list<Checkpoint *> CheckpointList_t;
+	typedef std::vector<ThreadData *> ThreadDataList_t;
+	typedef std::map<void *, StoreSiteProfile> StoreProfileMap_t;
 
 
 	int m_nThreads;
-	ThreadData *m_threads[N_THREADS];
+	ThreadDataList_t m_threads;
 	IThreadSelector *m_selector;
 
 	FunctionMap_t m_functions;
 	FunctionHandlerMap_t m_functionHandlers;
 	BreakpointMap_t m_breakpoints;
+	// Breakpoints on loads, only set for the detectors
+	SiteSet_t m_loadSites;
 
 	uint64_t m_startTimeStamp;
 
@@ -167,6 +714,47 @@ public:
 	int m_runLimit;
 	uint64_t m_timeLimit;
 
+	// Fork children from a template with all breakpoints armed
+	bool m_forkServer;
+	// ... which is re-created when this is set
+	bool m_breakpointsChanged;
+	// Keep the child between runs, and restore the pages it wrote
+	bool m_snapshotRestore;
+
+	// Break on stores relative to the stack or frame pointer
+	bool m_stackStores;
+
+	// Kept over all sessions. Sites are pruned after m_pruneRuns private runs
+	StoreProfileMap_t m_storeProfile;
+	unsigned int m_pruneRuns;
+
+	bool m_happensBefore;
+	bool m_lockset;
+	bool m_atomicity;
+
+	// Sites where a guided preemption has been done, kept over all runs
+	bool m_guidedPreemption;
+	SiteSet_t m_preemptedSites;
+
+	// Most recently used first
+	CheckpointList_t m_checkpoints;
+	unsigned int m_maxCheckpoints;
+
+	int m_workers;
+	// Non-NULL in worker processes
+	WorkerState *m_workerState;
+
+	// Sessions driven at the same time from this process
+	int m_concurrentSessions;
+	int m_liveSessions;
+	ExitHandler m_exitHandler;
+
+	// Fork the child of the next session while the current one runs
+	bool m_pipeline;
+
+	uint64_t m_phaseUs[N_PHASES];
+	unsigned long m_phaseRuns;
+
 	std::string m_error;
 
 	IElf *m_elf;
@@ -178,57 +766,159 @@ public:
 class coincident::Session : public Controller::IFunctionHandler
 {
 public:
-	Session(Controller &owner, int nThreads, Controller::ThreadData **threads);
+	Session(Controller &owner, int nThreads, const Controller::ThreadDataList_t &threads);
 
 	virtual ~Session();
 
 	void removeThread(int pid, int which);
 
+	void addSite(int id, void *addr);
+
 	bool handleBreakpoint(const PtraceEvent &ev);
 
-	bool continueExecution();
+	void profileAccess(void *site, void *addr, size_t size, bool isStore);
 
-	void switchThread(const PtraceEvent &ev);
+	bool wantsGuidedPreemption(void *site);
 
-	void releaseLastThread();
+	void guidedPreemption(void *site, int from);
 
-	bool run();
+	void onAcquire(IThread *thread, const void *object);
 
-	std::string backtraceToString(unsigned long *buf, int nValues);
+	void onRelease(IThread *thread, const void *object);
 
-	class ExitHandler : public Controller::IFunctionHandler
-	{
-	public:
-		ExitHandler(Session &owner);
+	void onLock(IThread *thread, const void *lock);
 
-		bool handle(IThread *cur, void *addr, const PtraceEvent &ev);
-	private:
-		Session &m_owner;
-	};
+	void onUnlock(IThread *thread, const void *lock);
 
-	// Default handler
-	bool handle(IThread *cur, void *addr, const PtraceEvent &ev);
+	void promoteHotSites();
+
+	bool continueExecution();
+
+	bool resume();
+
+	bool handleEvent(const PtraceEvent &ev);
+
+	bool keepRunning(bool handled);
+
+	void switchThread(const PtraceEvent &ev, bool guided = false);
+
+	void selectNextThread(const PtraceEvent &ev);
+
+	void setBlocked(IThread *thread, bool blocked);
+
+	void setRunnable(int which, bool runnable);
+
+	bool isRunnable(int which);
+
+	void rebuildRunnable();
+
+	void releaseLastThread();
+
+	void armBreakpoints();
+
+	int forkChild();
+
+	int resumeCheckpoint(Controller::Checkpoint &cp);
+
+	void maybeCheckpoint();
+
+	bool start(Controller::Checkpoint *cp);
+
+	void beginRun();
+
+	void finish();
+
+	bool run(Controller::Checkpoint *cp = NULL);
+
+	std::string backtraceToString(unsigned long *buf, int nValues);
+
+	bool threadExited(IThread *cur, const PtraceEvent &ev);
+
+	// Default handler
+	bool handle(IThread *cur, void *addr, const PtraceEvent &ev);
 
 	// Thread exit handler (just a marker)
 	static void threadExit();
 
+	// What a breakpoint ID means, filled in when the breakpoint is set
+	class BreakpointSite
+	{
+	public:
+		enum SiteType
+		{
+			SITE_NONE = 0,
+			SITE_STORE,
+			SITE_LOAD, // Only observed by the detectors
+			SITE_FUNCTION,
+			SITE_HANDLER,
+		};
+
+		enum SiteType type;
+		IFunction *function;
+		Controller::IFunctionHandler *handler;
+		unsigned long hits;
+	};
+
+	BreakpointSite lookupSite(void *addr);
+
+	typedef std::vector<BreakpointSite> BreakpointSiteTable_t;
+
 	Controller &m_owner;
 
-	ExitHandler m_exitHandler;
 	int m_nThreads;
 	int m_curPid;
 	int m_curThread;
 	bool m_lastThreadLoose;
+	unsigned long m_decisions;
+
+	std::vector<IThread *> m_threads;
+	BreakpointSiteTable_t m_sites;
+
+	// Unblocked threads, bit i for m_threads[i]
+	std::vector<unsigned long> m_runnableBits;
+	int m_nRunnable;
 
-	IThread **m_threads;
+	// For selectors without selectRunnable: the unblocked threads, and their index
+	std::vector<IThread *> m_runnable;
+	std::vector<int> m_runnableIndex;
+
+	// Index of each thread in m_threads, for setBlocked()
+	std::map<IThread *, int> m_threadIndex;
+
+	// Store sites currently in debug registers, and the number of store events
+	std::vector<int> m_hardwareSites;
+	unsigned long m_storeEvents;
+
+	// Used instead of the global ones with concurrent sessions
+	SemaphoreManager m_semaphores;
+
+	// The thread which has accessed a word in this run, and from which sites
+	class AddressOwner
+	{
+	public:
+		IThread *thread; // NULL when accessed by more than one thread
+		bool written;
+		std::vector<void *> sites; // Not yet known to be shared
+	};
+
+	typedef std::map<unsigned long, AddressOwner> AddressOwnerMap_t;
+
+	// For store pruning, cleared for each run
+	AddressOwnerMap_t m_addressOwners;
+	Controller::SiteSharingMap_t m_siteShared;
+
+	std::vector<IDetector *> m_detectors;
+	// At most one guided preemption per run
+	bool m_guidedDone;
+	// Started from a checkpoint, so the current thread is already set
+	bool m_resumed;
 };
 
 
-Controller::Controller()
+Controller::Controller() : m_exitHandler(*this)
 {
 	coin_set_cpu(getpid(), 0);
 
-	memset(m_threads, 0, sizeof(m_threads));
 	m_nThreads = 0;
 
 	m_schedulerLock = 0;
@@ -236,6 +926,27 @@ Controller::Controller()
 	m_runLimit = 0;
 	m_timeLimit = 0;
 
+	m_forkServer = false;
+	m_breakpointsChanged = true;
+	m_snapshotRestore = false;
+	m_maxCheckpoints = 0;
+	m_stackStores = false;
+	m_pruneRuns = 0;
+	m_happensBefore = false;
+	m_lockset = false;
+	m_atomicity = false;
+	m_guidedPreemption = false;
+
+	m_workers = 1;
+	m_workerState = NULL;
+
+	m_concurrentSessions = 1;
+	m_liveSessions = 0;
+	m_pipeline = false;
+
+	memset(m_phaseUs, 0, sizeof(m_phaseUs));
+	m_phaseRuns = 0;
+
 	m_selector = new DefaultThreadSelector();
 	m_startTimeStamp = getTimeStamp(0);
 
@@ -283,12 +994,9 @@ void Controller::setThreadSelector(IThreadSelector *selector)
 
 bool Controller::addThread(int (*fn)(void *), void *priv)
 {
-	int cur = m_nThreads;
-
-	m_nThreads++;
-
 	// Add the thread to the list
-	m_threads[cur] = new ThreadData(fn, priv);
+	m_threads.push_back(new ThreadData(fn, priv));
+	m_nThreads = m_threads.size();
 
 	return true;
 }
@@ -342,35 +1050,386 @@ bool Controller::unregisterFunctionHandler(void *functionAddress)
 
 bool Controller::run()
 {
-	int runsLeft = -1;
+	m_startTimeStamp = getTimeStamp(0);
+
+	/*
+	 * The detectors start over in each run, so a run resumed from a
+	 * checkpoint would miss the accesses before it.
+	 */
+	if ((m_happensBefore || m_lockset || m_atomicity) && m_maxCheckpoints > 0) {
+		error("Checkpoints can't be used with the race detectors, disabling them\n");
+		setCheckpoints(0);
+	}
+
+	if (m_selector->needsSerialRuns() && (m_workers > 1 || m_pipeline ||
+			m_concurrentSessions > 1 || m_maxCheckpoints > 0)) {
+		error("The thread selector needs the runs one at a time, without workers, pipeline, concurrent sessions or checkpoints\n");
+		return false;
+	}
+
+	if (m_workers > 1)
+		return runWorkers();
+
+	return runSessions();
+}
+
+bool Controller::runSessions()
+{
 	bool out;
 
-	if (m_runLimit)
-		runsLeft = m_runLimit;
+	memset(m_phaseUs, 0, sizeof(m_phaseUs));
+	m_phaseRuns = 0;
 
-	m_startTimeStamp = getTimeStamp(0);
+	if (m_concurrentSessions > 1)
+		out = runConcurrentSessions();
+	else if (m_pipeline)
+		out = runPipelined();
+	else
+		out = runSerial();
 
-	while (1) {
+	printPhaseTimes();
+
+	return out;
+}
+
+bool Controller::runSerial()
+{
+	int started = 0;
+	bool out = true;
+
+	while (claimRun(started)) {
 		Session cur(*this, m_nThreads, m_threads);
 
+		started++;
 		m_curSession = &cur;
-		out = cur.run();
+		out = cur.run(nextCheckpoint());
 		if (!out)
 			break;
+	}
+	m_curSession = NULL;
 
-		if (runsLeft > 0) {
-			runsLeft--;
+	return out;
+}
+
+/*
+ * Drive several sessions from this process, each with its own child. The
+ * events of the other children are handled while one of them runs, so the
+ * tracer doesn't sit idle during the context switches into the kernel.
+ */
+bool Controller::runConcurrentSessions()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+	std::map<int, Session *> running;
+	std::vector<Session *> idle;
+	int nSessions = m_concurrentSessions;
+	int started = 0;
+	bool out = true;
+
+	/*
+	 * Create the sessions up front, so that the thread stacks exist before
+	 * the fork server template is forked. Finished sessions are replaced,
+	 * which reuses their stacks.
+	 */
+	for (int i = 0; i < nSessions; i++)
+		idle.push_back(new Session(*this, m_nThreads, m_threads));
 
-			if (runsLeft == 0)
+	while (1) {
+		PtraceEvent ev;
+		Session *cur;
+		uint64_t ts;
+		int pid;
+
+		while (out && !idle.empty() && claimRun(started)) {
+			cur = idle.back();
+			idle.pop_back();
+			started++;
+
+			m_curSession = cur;
+			SemaphoreManager::setInstance(&cur->m_semaphores);
+			ts = getTimeStamp(0);
+			if (!cur->start(nextCheckpoint())) {
+				delete cur;
+				out = false;
 				break;
+			}
+			addPhaseTime(running.empty() ? PHASE_SETUP : PHASE_PREPARE, ts);
+			running[cur->m_curPid] = cur;
+			cur->beginRun();
+
+			if (!cur->resume())
+				reportError("Can't resume child %d\n", cur->m_curPid);
 		}
 
-		if (m_timeLimit &&
-				getTimeStamp(m_startTimeStamp) > m_timeLimit)
+		if (running.empty() || !out || !m_error.empty())
 			break;
+
+		pid = ptrace.waitEvent(ev);
+		if (running.find(pid) == running.end()) {
+			error("Event from unknown child %d\n", pid);
+			out = false;
+			break;
+		}
+		cur = running[pid];
+
+		m_curSession = cur;
+		SemaphoreManager::setInstance(&cur->m_semaphores);
+		if (cur->keepRunning(cur->handleEvent(ev))) {
+			if (cur->resume())
+				continue;
+			reportError("Can't resume child %d\n", pid);
+		}
+
+		// Run done
+		running.erase(pid);
+		ts = getTimeStamp(0);
+		cur->finish();
+		addPhaseTime(PHASE_TEARDOWN, ts);
+		out = cur->m_nThreads == 0;
+		delete cur;
+		if (!out)
+			break;
+
+		idle.push_back(new Session(*this, m_nThreads, m_threads));
+	}
+
+	// Stop the runs which are still going after an error
+	for (std::map<int, Session *>::iterator it = running.begin();
+			it != running.end(); it++) {
+		m_curSession = it->second;
+		ptrace.selectChild(it->first);
+		it->second->finish();
+		delete it->second;
 	}
+	for (unsigned int i = 0; i < idle.size(); i++)
+		delete idle[i];
+
+	SemaphoreManager::setInstance(NULL);
 	m_curSession = NULL;
 
+	return out && m_error.empty();
+}
+
+/*
+ * Run the sessions one at a time, but fork and arm the child for the next
+ * session while the current child runs. The fork and setup latency is
+ * then hidden behind the run, unless the child stops right away.
+ */
+bool Controller::runPipelined()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+	// Both created before any fork, so the stacks exist in the template
+	Session *cur = new Session(*this, m_nThreads, m_threads);
+	Session *next = new Session(*this, m_nThreads, m_threads);
+	bool nextReady = false;
+	bool more = true;
+	int started = 0;
+	bool out = true;
+
+	while (out) {
+		bool going = true;
+		uint64_t ts;
+
+		if (!nextReady) {
+			if (!more || !claimRun(started))
+				break;
+			started++;
+
+			ts = getTimeStamp(0);
+			if (!prepareSession(*next)) {
+				out = false;
+				break;
+			}
+			addPhaseTime(PHASE_SETUP, ts);
+		}
+		std::swap(cur, next);
+		nextReady = false;
+
+		m_curSession = cur;
+		ptrace.selectChild(cur->m_curPid);
+		cur->beginRun();
+
+		ts = getTimeStamp(0);
+		while (going) {
+			PtraceEvent ev;
+
+			if (!cur->resume()) {
+				reportError("Can't resume child %d\n", cur->m_curPid);
+				break;
+			}
+
+			// Setup the next run while this child runs
+			if (!nextReady && more && out) {
+				uint64_t prepareTs = getTimeStamp(0);
+
+				more = claimRun(started);
+				if (more) {
+					started++;
+					nextReady = prepareSession(*next);
+					out = nextReady;
+					addPhaseTime(PHASE_PREPARE, prepareTs);
+					// Not part of this run
+					ts += getTimeStamp(prepareTs);
+				}
+			}
+
+			if (ptrace.waitEvent(ev) != cur->m_curPid) {
+				reportError("Lost child %d\n", cur->m_curPid);
+				break;
+			}
+			m_curSession = cur;
+			going = cur->keepRunning(cur->handleEvent(ev));
+		}
+		ts = addPhaseTime(PHASE_RUN, ts);
+
+		cur->finish();
+		addPhaseTime(PHASE_TEARDOWN, ts);
+		if (cur->m_nThreads != 0 || !m_error.empty())
+			out = false;
+
+		// Reuses the stacks
+		delete cur;
+		cur = new Session(*this, m_nThreads, m_threads);
+	}
+
+	// Prepared for a run which never came
+	if (nextReady) {
+		ptrace.selectChild(next->m_curPid);
+		next->finish();
+	}
+	delete cur;
+	delete next;
+	m_curSession = NULL;
+
+	return out;
+}
+
+bool Controller::prepareSession(Session &session)
+{
+	Session *last = m_curSession;
+	bool out;
+
+	m_curSession = &session;
+	out = session.start(nextCheckpoint());
+	m_curSession = last;
+
+	return out;
+}
+
+uint64_t Controller::addPhaseTime(enum Phase phase, uint64_t start)
+{
+	uint64_t now = getTimeStamp(0);
+
+	m_phaseUs[phase] += now - start;
+
+	return now;
+}
+
+void Controller::printPhaseTimes()
+{
+	const char *names[N_PHASES] = {"setup", "background setup", "run", "teardown"};
+
+	if (m_phaseRuns == 0)
+		return;
+
+	coin_debug(INFO_MSG, "INFO: Time per run over %lu runs:\n", m_phaseRuns);
+	for (int i = 0; i < N_PHASES; i++)
+		coin_debug(INFO_MSG, "INFO:   %-16s %10.1f us\n",
+				names[i], (double)m_phaseUs[i] / m_phaseRuns);
+}
+
+// Check the run and time limits before starting another run
+bool Controller::claimRun(int started)
+{
+	// The run limit is shared between all workers
+	if (m_workerState) {
+		if (m_workerState->stop)
+			return false;
+
+		if (m_runLimit &&
+				__sync_fetch_and_sub(&m_workerState->runsLeft, 1) <= 0)
+			return false;
+	} else if (m_runLimit && started >= m_runLimit) {
+		return false;
+	}
+
+	if (started > 0 && m_timeLimit &&
+			getTimeStamp(m_startTimeStamp) > m_timeLimit)
+		return false;
+
+	return true;
+}
+
+/*
+ * Run sessions in parallel in forked worker processes, each pinned to
+ * its own CPU. Each worker has its own ptrace instance, breakpoints and
+ * selector since it's a separate process. The first error stops all
+ * workers before their next run.
+ */
+bool Controller::runWorkers()
+{
+	long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	std::vector<pid_t> workers;
+	WorkerState *state;
+	bool out;
+
+	state = (WorkerState *)mmap(NULL, sizeof(WorkerState), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED) {
+		error("Can't map worker state, running serially\n");
+
+		return runSessions();
+	}
+	memset(state, 0, sizeof(*state));
+	state->runsLeft = m_runLimit;
+
+	if (nCpus < 1)
+		nCpus = 1;
+
+	for (int i = 0; i < m_workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			error("Can't fork worker %d\n", i);
+			break;
+		}
+
+		if (pid == 0) {
+			m_workerState = state;
+
+			// The ptrace layer may exist already, and its area is shared with the other workers
+			IPtrace::getInstance().remapDisplacedArea();
+
+			coin_set_cpu(getpid(), i % nCpus);
+			// Different schedules in each worker
+			srand(i + 1);
+
+			out = runSessions();
+			if (!out && __sync_bool_compare_and_swap(&state->failed, 0, 1))
+				strncpy(state->error, m_error.c_str(), sizeof(state->error) - 1);
+			if (!out)
+				state->stop = 1;
+
+			cleanup();
+			_exit(out ? 0 : 1);
+		}
+
+		workers.push_back(pid);
+	}
+
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		int status;
+
+		waitpid(workers[i], &status, 0);
+		if (!WIFEXITED(status))
+			state->failed = 1;
+	}
+
+	out = !workers.empty() && !state->failed;
+	if (state->error[0] != '\0')
+		m_error = state->error;
+
+	munmap(state, sizeof(*state));
+
 	return out;
 }
 
@@ -379,15 +1438,179 @@ void Controller::setRuns(int nRuns)
 	m_runLimit = nRuns;
 }
 
+void Controller::setWorkers(int nWorkers)
+{
+	m_workers = nWorkers > 1 ? nWorkers : 1;
+}
+
+void Controller::setConcurrentSessions(int nSessions)
+{
+	m_concurrentSessions = nSessions > 1 ? nSessions : 1;
+}
+
+void Controller::setPipeline(bool enabled)
+{
+	m_pipeline = enabled;
+}
+
 void Controller::setTimeLimit(int ms)
 {
 	m_timeLimit = ms * 1000;
 }
 
+void Controller::setForkServer(bool enabled)
+{
+	if (!enabled) {
+		IPtrace::getInstance().killTemplate();
+		m_snapshotRestore = false;
+	}
+
+	m_forkServer = enabled;
+	m_breakpointsChanged = true;
+}
+
+void Controller::setSnapshotRestore(bool enabled)
+{
+	// Restores from the fork server template
+	if (enabled)
+		setForkServer(true);
+
+	m_snapshotRestore = enabled;
+}
+
+void Controller::setCheckpoints(int maxCheckpoints)
+{
+	m_maxCheckpoints = maxCheckpoints > 0 ? maxCheckpoints : 0;
+
+	while (m_checkpoints.size() > m_maxCheckpoints)
+		releaseCheckpoint(m_checkpoints.back());
+}
+
+void Controller::setStackStores(bool enabled)
+{
+	m_stackStores = enabled;
+}
+
+void Controller::setStorePruning(int nRuns)
+{
+	m_pruneRuns = nRuns > 0 ? nRuns : 0;
+}
+
+/*
+ * Add the store sites of a finished run to the profile, and disarm those
+ * which have only written thread-private addresses for long enough.
+ */
+void Controller::updateStoreProfile(const SiteSharingMap_t &sites)
+{
+	for (SiteSharingMap_t::const_iterator it = sites.begin();
+			it != sites.end(); it++) {
+		StoreProfileMap_t::iterator profIt = m_storeProfile.find(it->first);
+
+		if (profIt == m_storeProfile.end()) {
+			StoreSiteProfile empty;
+
+			empty.privateRuns = 0;
+			empty.shared = false;
+			profIt = m_storeProfile.insert(std::make_pair(it->first, empty)).first;
+		}
+
+		StoreSiteProfile &cur = profIt->second;
+
+		if (cur.shared)
+			continue;
+		if (it->second) {
+			cur.shared = true;
+			continue;
+		}
+
+		if (++cur.privateRuns < m_pruneRuns)
+			continue;
+
+		// Re-creates the fork server template without it
+		if (m_breakpoints.erase(it->first)) {
+			m_breakpointsChanged = true;
+			coin_debug(BP_MSG, "BP pruned %p, only thread-private accesses in %u runs\n",
+					it->first, cur.privateRuns);
+		}
+	}
+}
+
+void Controller::setHappensBefore(bool enabled)
+{
+	m_happensBefore = enabled;
+}
+
+void Controller::setLockset(bool enabled)
+{
+	m_lockset = enabled;
+}
+
+void Controller::setAtomicity(bool enabled)
+{
+	m_atomicity = enabled;
+}
+
+void Controller::setGuidedPreemption(bool enabled)
+{
+	m_guidedPreemption = enabled;
+}
+
+bool Controller::isPruned(void *site)
+{
+	if (m_pruneRuns == 0)
+		return false;
+
+	StoreProfileMap_t::iterator it = m_storeProfile.find(site);
+
+	return it != m_storeProfile.end() && !it->second.shared &&
+			it->second.privateRuns >= m_pruneRuns;
+}
+
+// The most recently used checkpoint with unexplored choices left
+Controller::Checkpoint *Controller::nextCheckpoint()
+{
+	while (!m_checkpoints.empty()) {
+		Checkpoint *cp = m_checkpoints.front();
+
+		if (std::find(cp->tried.begin(), cp->tried.end(), false) != cp->tried.end())
+			return cp;
+
+		releaseCheckpoint(cp);
+	}
+
+	return NULL;
+}
+
+void Controller::addCheckpoint(Checkpoint *cp)
+{
+	m_checkpoints.push_front(cp);
+
+	// Evict the least recently used
+	while (m_checkpoints.size() > m_maxCheckpoints)
+		releaseCheckpoint(m_checkpoints.back());
+}
+
+void Controller::releaseCheckpoint(Checkpoint *cp)
+{
+	m_checkpoints.remove(cp);
+
+	IPtrace::getInstance().releaseCheckpoint(cp->pid);
+	for (unsigned int i = 0; i < cp->threads.size(); i++)
+		ThreadFactory::releaseCopy(cp->threads[i]);
+
+	delete cp;
+}
+
 void Controller::cleanup()
 {
+	while (!m_checkpoints.empty())
+		releaseCheckpoint(m_checkpoints.front());
+
 	if (m_selector)
 		delete m_selector;
+
+	if (m_forkServer)
+		IPtrace::getInstance().killTemplate();
 }
 
 uint64_t Controller::getTimeStamp(uint64_t start)
@@ -425,6 +1648,50 @@ void Controller::forceReschedule()
 	m_curSession->switchThread(ev);
 }
 
+void Controller::blockThread(IThread *thread)
+{
+	if (!m_curSession) {
+		thread->block();
+		return;
+	}
+
+	m_curSession->setBlocked(thread, true);
+}
+
+void Controller::unBlockThread(IThread *thread)
+{
+	if (!m_curSession) {
+		thread->unBlock();
+		return;
+	}
+
+	m_curSession->setBlocked(thread, false);
+}
+
+void Controller::onAcquire(IThread *thread, const void *object)
+{
+	if (m_curSession && thread)
+		m_curSession->onAcquire(thread, object);
+}
+
+void Controller::onRelease(IThread *thread, const void *object)
+{
+	if (m_curSession && thread)
+		m_curSession->onRelease(thread, object);
+}
+
+void Controller::onLock(IThread *thread, const void *lock)
+{
+	if (m_curSession && thread)
+		m_curSession->onLock(thread, lock);
+}
+
+void Controller::onUnlock(IThread *thread, const void *lock)
+{
+	if (m_curSession && thread)
+		m_curSession->onUnlock(thread, lock);
+}
+
 void Controller::reportError(const char *fmt, ...)
 {
 	int n, size = 1024;
@@ -441,194 +1708,630 @@ void Controller::reportError(const char *fmt, ...)
 
 	panic_if (n < 0, "Too long error description");
 
-	m_error = str;
+	m_error = str;
+}
+
+const char *Controller::getError()
+{
+	if (m_error.empty())
+		return NULL;
+
+	return m_error.c_str();
+}
+
+
+
+Session::Session(Controller &owner, int nThreads, const Controller::ThreadDataList_t &threads) :
+						m_owner(owner), m_nThreads(nThreads)
+{
+	m_threads.resize(m_nThreads);
+	m_runnable.reserve(m_nThreads);
+	m_runnableIndex.reserve(m_nThreads);
+	m_curThread = 0;
+	m_curPid = 0;
+	m_lastThreadLoose = false;
+	m_storeEvents = 0;
+	m_decisions = 0;
+	m_guidedDone = false;
+	m_resumed = false;
+
+	for (int i = 0; i < m_nThreads; i++) {
+		Controller::ThreadData *p = threads[i];
+
+		m_threads[i] = &ThreadFactory::createThread(Session::threadExit,
+				p->m_fn, p->m_priv);
+	}
+	rebuildRunnable();
+
+	if (m_owner.m_happensBefore)
+		m_detectors.push_back(IDetector::createHappensBefore());
+	if (m_owner.m_lockset)
+		m_detectors.push_back(IDetector::createLockset());
+	if (m_owner.m_atomicity)
+		m_detectors.push_back(IDetector::createAtomicity());
+
+	m_owner.m_liveSessions++;
+	m_owner.registerFunctionHandler((void *)Session::threadExit,
+			&m_owner.m_exitHandler);
+}
+
+Session::~Session()
+{
+	for (int i = 0; i < m_nThreads; i++)
+		ThreadFactory::releaseThread(*m_threads[i]);
+
+	m_semaphores.clearSemaphores();
+
+	for (unsigned int i = 0; i < m_detectors.size(); i++)
+		delete m_detectors[i];
+
+	// Still used by the other concurrent sessions
+	if (--m_owner.m_liveSessions == 0)
+		m_owner.unregisterFunctionHandler((void *)Session::threadExit);
+}
+
+// Thread exit handler (just a marker)
+void Session::threadExit()
+{
+}
+
+
+void Session::removeThread(int pid, int which)
+{
+	if (m_nThreads < 1)
+		return;
+
+	m_threadIndex.erase(m_threads[which]);
+	ThreadFactory::releaseThread(*m_threads[which]);
+
+	if (isRunnable(which))
+		m_nRunnable--;
+
+	// Swap threads
+	if (which != m_nThreads) {
+		m_threads[which] = m_threads[m_nThreads - 1];
+		setRunnable(which, isRunnable(m_nThreads - 1));
+		if (which != m_nThreads - 1)
+			m_threadIndex[m_threads[which]] = which;
+	}
+	setRunnable(m_nThreads - 1, false);
+
+	m_threads.pop_back();
+	m_nThreads--;
+
+	if (which == m_curThread || m_curThread >= m_nThreads)
+		m_curThread = 0;
+
+	if (m_nThreads > 0)
+		m_threads[0]->loadRegisters();
+}
+
+Controller::ExitHandler::ExitHandler(Controller &owner) : m_owner(owner)
+{
+}
+
+bool Controller::ExitHandler::handle(IThread *cur, void *addr, const PtraceEvent &ev)
+{
+	if (!m_owner.m_curSession)
+		return false;
+
+	return m_owner.m_curSession->threadExited(cur, ev);
+}
+
+bool Session::threadExited(IThread *cur, const PtraceEvent &ev)
+{
+	removeThread(m_curPid, m_curThread);
+
+	coin_debug(BP_MSG, "Thread %p exited\n", cur);
+
+	if (m_nThreads == 0)
+		return false;
+
+	switchThread(ev);
+
+	return true;
+}
+
+bool Session::handle(IThread *cur, void *addr, const PtraceEvent &ev)
+{
+	Controller::FunctionMap_t::iterator fnIt = m_owner.m_functions.find(addr);
+	IPtrace &ptrace = IPtrace::getInstance();
+
+	panic_if(fnIt == m_owner.m_functions.end(),
+			"Function breakpoint at %p, but no function there", addr);
+	IFunction *function = fnIt->second;
+
+	m_threads[m_curThread]->stepOverBreakpoint();
+	// Visited a function for the first time, setup breakpoints
+	if (ptrace.clearBreakpoint(ev.eventId) == false) {
+		error("Can't clear function breakpoint???");
+
+		return false;
+	}
+	if (ev.eventId >= 0 && (unsigned int)ev.eventId < m_sites.size())
+		m_sites[ev.eventId].type = BreakpointSite::SITE_NONE;
+
+	m_owner.m_breakpoints.erase(function->getEntry());
+	m_owner.m_breakpointsChanged = true;
+	// Don't setup breakpoints in libraries
+	if (function->getType() == IFunction::SYM_DYNAMIC)
+		return true;
+	coin_debug(BP_MSG, "BP visited %s at %p\n",
+			function->getName(), function->getEntry());
+
+	IFunction::ReferenceList_t &refs = function->getMemoryStores();
+	std::vector<void *> addrs(refs.begin(), refs.end());
+
+	if (m_owner.m_stackStores) {
+		IFunction::ReferenceList_t &stackRefs = function->getStackMemoryStores();
+
+		addrs.insert(addrs.end(), stackRefs.begin(), stackRefs.end());
+	}
+
+	/*
+	 * Loads for the detectors, which are not scheduling points. With store
+	 * pruning, a store is only private if no other thread reads what it
+	 * wrote either, so the loads are profiled until they are pruned too.
+	 */
+	if (!m_detectors.empty() || m_owner.m_selector->wantsAccesses() ||
+			m_owner.m_pruneRuns > 0) {
+		IFunction::ReferenceList_t &loads = function->getMemoryLoads();
+
+		m_owner.m_loadSites.insert(loads.begin(), loads.end());
+		addrs.insert(addrs.end(), loads.begin(), loads.end());
+
+		if (m_owner.m_stackStores) {
+			IFunction::ReferenceList_t &stackLoads = function->getStackMemoryLoads();
+
+			m_owner.m_loadSites.insert(stackLoads.begin(), stackLoads.end());
+			addrs.insert(addrs.end(), stackLoads.begin(), stackLoads.end());
+		}
+	}
+
+	// Sites found to only write thread-private memory in earlier runs
+	if (m_owner.m_pruneRuns > 0) {
+		unsigned int n = 0;
+
+		for (unsigned int i = 0; i < addrs.size(); i++) {
+			if (!m_owner.isPruned(addrs[i]))
+				addrs[n++] = addrs[i];
+		}
+		addrs.resize(n);
+	}
+
+	std::vector<int> ids(addrs.size(), -1);
+
+	if (addrs.empty())
+		return true;
+
+	if (!ptrace.setBreakpoints(&addrs[0], &ids[0], addrs.size()))
+		error("Can't set breakpoint???");
+
+	for (unsigned int i = 0; i < addrs.size(); i++) {
+		coin_debug(BP_MSG, "BP set at %p\n", addrs[i]);
+
+		m_owner.m_breakpoints[addrs[i]] = 1;
+		addSite(ids[i], addrs[i]);
+	}
+
+	return true;
+}
+
+Session::BreakpointSite Session::lookupSite(void *addr)
+{
+	BreakpointSite out;
+
+	out.type = BreakpointSite::SITE_STORE;
+	out.function = NULL;
+	out.handler = NULL;
+	out.hits = 0;
+
+	Controller::FunctionMap_t::iterator fnIt = m_owner.m_functions.find(addr);
+	if (fnIt == m_owner.m_functions.end() || !fnIt->second) {
+		if (m_owner.m_loadSites.find(addr) != m_owner.m_loadSites.end())
+			out.type = BreakpointSite::SITE_LOAD;
+
+		return out;
+	}
+
+	out.function = fnIt->second;
+
+	// Assume default handler
+	out.type = BreakpointSite::SITE_FUNCTION;
+	out.handler = this;
+
+	Controller::FunctionHandlerMap_t::iterator it = m_owner.m_functionHandlers.find(addr);
+	if (it != m_owner.m_functionHandlers.end()) {
+		out.type = BreakpointSite::SITE_HANDLER;
+		out.handler = it->second;
+	}
+
+	return out;
+}
+
+void Session::addSite(int id, void *addr)
+{
+	if (id < 0)
+		return;
+
+	if ((unsigned int)id >= m_sites.size()) {
+		BreakpointSite none;
+
+		none.type = BreakpointSite::SITE_NONE;
+		none.function = NULL;
+		none.handler = NULL;
+		none.hits = 0;
+		m_sites.resize(id + 1, none);
+	}
+
+	m_sites[id] = lookupSite(addr);
+}
+
+
+bool Session::handleBreakpoint(const PtraceEvent &ev)
+{
+	BreakpointSite site;
+
+	/*
+	 * Precomputed when the breakpoint was set, otherwise lookup by address.
+	 * Breakpoints inherited from a fork server template are added here.
+	 */
+	if (ev.eventId >= 0) {
+		if ((unsigned int)ev.eventId >= m_sites.size() ||
+				m_sites[ev.eventId].type == BreakpointSite::SITE_NONE)
+			addSite(ev.eventId, ev.addr);
+		site = m_sites[ev.eventId];
+	} else {
+		site = lookupSite(ev.addr);
+	}
+
+	m_threads[m_curThread]->saveRegisters();
+
+	if (site.type != BreakpointSite::SITE_STORE &&
+			site.type != BreakpointSite::SITE_LOAD)
+		return site.handler->handle(m_threads[m_curThread], ev.addr, ev);
+
+	Controller::IThreadSelector *selector = m_owner.m_selector;
+	bool selectorAccesses = selector->wantsAccesses();
+	bool preempt = false;
+
+	// Decoded before the step, which moves the PC
+	if (m_owner.m_pruneRuns > 0 || !m_detectors.empty() || selectorAccesses) {
+		IThread *cur = m_threads[m_curThread];
+		size_t size = 0;
+		void *addr = cur->getMemoryAddress(&size);
+
+		/*
+		 * Postponed by the selector: switch without stepping, so the thread
+		 * traps here again. Not for debug register breakpoints, since the
+		 * kernel sets the resume flag which skips them once.
+		 */
+		if (addr && selectorAccesses && !m_owner.m_schedulerLock &&
+				!IPtrace::getInstance().stoppedAtHardwareBreakpoint() &&
+				selector->onAccess(cur, ev.addr, addr, size,
+						site.type == BreakpointSite::SITE_STORE)) {
+			switchThread(ev);
+			return true;
+		}
+
+		if (m_owner.m_pruneRuns > 0 && !m_owner.isPruned(ev.addr))
+			profileAccess(ev.addr, addr, size,
+					site.type == BreakpointSite::SITE_STORE);
+
+		for (unsigned int i = 0; addr && i < m_detectors.size(); i++) {
+			if (m_detectors[i]->onAccess(cur, ev.addr, addr, size,
+					site.type == BreakpointSite::SITE_STORE))
+				m_owner.reportError("%s\n", m_detectors[i]->getReport());
+			if (m_detectors[i]->wantsPreemption())
+				preempt = true;
+		}
+	}
+
+	// Step to next instruction
+	m_threads[m_curThread]->stepOverBreakpoint();
+
+	if (site.type == BreakpointSite::SITE_LOAD) {
+		if (preempt && wantsGuidedPreemption(ev.addr))
+			switchThread(ev, true);
+		return true;
+	}
+
+	if (ev.eventId >= 0 && (unsigned int)ev.eventId < m_sites.size())
+		m_sites[ev.eventId].hits++;
+	if (++m_storeEvents % HW_PROMOTE_INTERVAL == 0)
+		promoteHotSites();
+
+	// No reschedules if this is set
+	if (m_owner.m_schedulerLock)
+		return true;
+
+	switchThread(ev, preempt && wantsGuidedPreemption(ev.addr));
+	maybeCheckpoint();
+
+	return true;
 }
 
-const char *Controller::getError()
+/*
+ * Switch to another runnable thread between two accesses of the current
+ * one, so that the interleavings the detectors look for happen within a
+ * few runs instead of by chance. Each site is tried once, in the first
+ * run which reaches it.
+ */
+bool Session::wantsGuidedPreemption(void *site)
 {
-	if (m_error.empty())
-		return NULL;
+	if (!m_owner.m_guidedPreemption || m_owner.m_schedulerLock || m_guidedDone)
+		return false;
 
-	return m_error.c_str();
+	if (m_owner.m_preemptedSites.find(site) != m_owner.m_preemptedSites.end())
+		return false;
+
+	return m_nRunnable - (isRunnable(m_curThread) ? 1 : 0) > 0;
 }
 
+// Override the choice of the selector with another thread than @a from
+void Session::guidedPreemption(void *site, int from)
+{
+	int others = m_nRunnable - (isRunnable(from) ? 1 : 0);
 
+	if (others <= 0)
+		return;
 
-Session::Session(Controller &owner, int nThreads, Controller::ThreadData **threads) :
-						m_owner(owner), m_nThreads(nThreads), m_exitHandler(*this)
-{
-	m_threads = new IThread*[m_nThreads];
-	m_curThread = 0;
-	m_curPid = 0;
-	m_lastThreadLoose = false;
+	int n = rand() % others;
 
 	for (int i = 0; i < m_nThreads; i++) {
-		Controller::ThreadData *p = threads[i];
+		if (i == from || !isRunnable(i))
+			continue;
 
-		m_threads[i] = &ThreadFactory::createThread(Session::threadExit,
-				p->m_fn, p->m_priv);
-	}
+		if (n-- > 0)
+			continue;
 
-	m_owner.registerFunctionHandler((void *)Session::threadExit,
-			&m_exitHandler);
+		coin_debug(INFO_MSG, "INFO: Guided preemption at %p, thread %d -> %d\n",
+				site, from, i);
+		m_owner.m_preemptedSites.insert(site);
+		m_guidedDone = true;
+		m_curThread = i;
+
+		return;
+	}
 }
 
-Session::~Session()
+/*
+ * Record which thread the access at a site is to, word by word. A site is
+ * shared if it has accessed a word which another thread also accesses, and
+ * at least one of the accesses is a store. Accesses which can't be decoded
+ * are assumed to be shared.
+ */
+void Session::profileAccess(void *site, void *addr, size_t size, bool isStore)
 {
-	for (int i = 0; i < m_nThreads; i++)
-		ThreadFactory::releaseThread(*m_threads[i]);
+	IThread *cur = m_threads[m_curThread];
+	bool &shared = m_siteShared[site];
 
-	delete[] m_threads;
+	if (!addr || size == 0) {
+		shared = true;
+		return;
+	}
 
-	m_owner.unregisterFunctionHandler((void *)Session::threadExit);
-}
+	for_each_word(word, addr, size) {
+		AddressOwnerMap_t::iterator it = m_addressOwners.find(word);
 
-// Thread exit handler (just a marker)
-void Session::threadExit()
-{
-}
+		if (it == m_addressOwners.end()) {
+			AddressOwner &owner = m_addressOwners[word];
 
+			owner.thread = cur;
+			owner.written = isStore;
+			owner.sites.push_back(site);
+			continue;
+		}
 
-void Session::removeThread(int pid, int which)
-{
-	if (m_nThreads < 1)
-		return;
+		AddressOwner &owner = it->second;
 
-	ThreadFactory::releaseThread(*m_threads[which]);
+		if (owner.thread != cur)
+			owner.thread = NULL;
+		owner.written = owner.written || isStore;
 
-	// Swap threads
-	if (which != m_nThreads)
-		m_threads[which] = m_threads[m_nThreads - 1];
+		// Private, or only read by several threads so far
+		if (owner.thread || !owner.written) {
+			if (std::find(owner.sites.begin(), owner.sites.end(), site) == owner.sites.end())
+				owner.sites.push_back(site);
+			continue;
+		}
 
-	m_nThreads--;
+		// Written and accessed by two threads, so all sites which accessed it are shared
+		for (unsigned int i = 0; i < owner.sites.size(); i++)
+			m_siteShared[owner.sites[i]] = true;
+		owner.sites.clear();
+		shared = true;
+	}
+}
 
-	if (which == m_curThread || m_curThread >= m_nThreads)
-		m_curThread = 0;
+void Session::onAcquire(IThread *thread, const void *object)
+{
+	for (unsigned int i = 0; i < m_detectors.size(); i++)
+		m_detectors[i]->onAcquire(thread, object);
+}
 
-	if (m_nThreads > 0)
-		m_threads[0]->loadRegisters();
+void Session::onRelease(IThread *thread, const void *object)
+{
+	for (unsigned int i = 0; i < m_detectors.size(); i++)
+		m_detectors[i]->onRelease(thread, object);
 }
 
-Session::ExitHandler::ExitHandler(Session &owner) : m_owner(owner)
+void Session::onLock(IThread *thread, const void *lock)
 {
+	for (unsigned int i = 0; i < m_detectors.size(); i++)
+		m_detectors[i]->onLock(thread, lock);
 }
 
-bool Session::ExitHandler::handle(IThread *cur, void *addr, const PtraceEvent &ev)
+void Session::onUnlock(IThread *thread, const void *lock)
 {
-	m_owner.removeThread(m_owner.m_curPid, m_owner.m_curThread);
+	for (unsigned int i = 0; i < m_detectors.size(); i++)
+		m_detectors[i]->onUnlock(thread, lock);
+}
 
-	coin_debug(BP_MSG, "Thread %p exited\n", cur);
+/*
+ * Move the most frequently hit store sites to the debug registers, which
+ * avoids the int3 step-over for them.
+ */
+void Session::promoteHotSites()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+	int hottest[N_HW_BREAKPOINTS];
+	int n = 0;
 
-	if (m_owner.m_nThreads == 0)
-		return false;
+	for (unsigned int id = 0; id < m_sites.size(); id++) {
+		const BreakpointSite &cur = m_sites[id];
 
-	m_owner.switchThread(ev);
+		if (cur.type != BreakpointSite::SITE_STORE ||
+				cur.hits < HW_PROMOTE_MIN_HITS)
+			continue;
 
-	return true;
-}
+		if (n == N_HW_BREAKPOINTS && m_sites[hottest[n - 1]].hits >= cur.hits)
+			continue;
 
-bool Session::handle(IThread *cur, void *addr, const PtraceEvent &ev)
-{
-	IFunction *function = m_owner.m_functions[addr];
-	IPtrace &ptrace = IPtrace::getInstance();
+		// Insertion sort, hottest first
+		int i = n < N_HW_BREAKPOINTS ? n++ : n - 1;
 
-	m_threads[m_curThread]->stepOverBreakpoint();
-	// Visited a function for the first time, setup breakpoints
-	if (ptrace.clearBreakpoint(ev.eventId) == false) {
-		error("Can't clear function breakpoint???");
+		while (i > 0 && m_sites[hottest[i - 1]].hits < cur.hits) {
+			hottest[i] = hottest[i - 1];
+			i--;
+		}
+		hottest[i] = id;
+	}
 
-		return false;
+	// Free the debug registers of sites which are no longer hot
+	for (unsigned int i = 0; i < m_hardwareSites.size(); ) {
+		int id = m_hardwareSites[i];
+
+		if (std::find(hottest, hottest + n, id) != hottest + n) {
+			i++;
+			continue;
+		}
+		ptrace.clearHardwareBreakpoint(id);
+		m_hardwareSites.erase(m_hardwareSites.begin() + i);
 	}
 
-	m_owner.m_breakpoints.erase(function->getEntry());
-	// Don't setup breakpoints in libraries
-	if (function->getType() == IFunction::SYM_DYNAMIC)
-		return true;
-	coin_debug(BP_MSG, "BP visited %s at %p\n",
-			function->getName(), function->getEntry());
+	for (int i = 0; i < n; i++) {
+		int id = hottest[i];
 
-	IFunction::ReferenceList_t refs = function->getMemoryStores();
+		if (std::find(m_hardwareSites.begin(), m_hardwareSites.end(), id) != m_hardwareSites.end())
+			continue;
 
-	for (IFunction::ReferenceList_t::iterator it = refs.begin();
-			it != refs.end(); it++) {
-		coin_debug(BP_MSG, "BP set at %p\n", *it);
-		if (ptrace.setBreakpoint(*it) < 0)
-			error("Can't set breakpoint???");
+		if (!ptrace.setHardwareBreakpoint(id))
+			break;
 
-		m_owner.m_breakpoints[*it] = 1;
+		coin_debug(BP_MSG, "BP %d moved to debug register (%lu hits)\n",
+				id, m_sites[id].hits);
+		m_hardwareSites.push_back(id);
 	}
-
-	return true;
 }
 
+/*
+ * The selector always sees the event, so that it counts the same ones
+ * whether or not a @a guided preemption overrides its choice afterwards.
+ */
+void Session::switchThread(const PtraceEvent &ev, bool guided)
+{
+	int from = m_curThread;
 
-bool Session::handleBreakpoint(const PtraceEvent &ev)
+	selectNextThread(ev);
+	if (guided)
+		guidedPreemption(ev.addr, from);
+}
+
+void Session::selectNextThread(const PtraceEvent &ev)
 {
-	IFunction *function = m_owner.m_functions[ev.addr];
+	int nextThread;
+	int cur = -1;
 
-	m_threads[m_curThread]->saveRegisters();
+	nextThread = m_owner.m_selector->selectRunnable(m_curThread,
+			m_threads.empty() ? NULL : &m_threads[0], m_nThreads,
+			&m_runnableBits[0], m_nRunnable,
+			m_owner.getTimeStamp(m_owner.m_startTimeStamp), &ev);
+	if (nextThread >= 0) {
+		if (nextThread < m_nThreads)
+			m_curThread = nextThread;
+		return;
+	}
 
-	if (function) {
-		// Assume default handler
-		IFunctionHandler *handler = this;
+	// Filter out blocked threads
+	m_runnable.clear();
+	m_runnableIndex.clear();
+	for (int word = 0; word < (int)m_runnableBits.size(); word++) {
+		unsigned long bits = m_runnableBits[word];
 
-		Controller::FunctionHandlerMap_t::iterator it = m_owner.m_functionHandlers.find(ev.addr);
-		if (it != m_owner.m_functionHandlers.end())
-			handler = it->second;
+		while (bits) {
+			int i = word * BITS_PER_WORD + __builtin_ctzl(bits);
 
-		return handler->handle(m_threads[m_curThread], ev.addr, ev);
-	}
+			bits &= bits - 1;
 
-	// Step to next instruction
-	m_threads[m_curThread]->stepOverBreakpoint();
+			// Might not be the same
+			if (m_curThread == i)
+				cur = m_runnable.size();
 
-	// No reschedules if this is set
-	if (m_owner.m_schedulerLock)
-		return true;
+			m_runnable.push_back(m_threads[i]);
+			m_runnableIndex.push_back(i);
+		}
+	}
 
-	switchThread(ev);
+	nextThread = m_owner.m_selector->selectThread(cur,
+			m_runnable.empty() ? NULL : &m_runnable[0], m_runnable.size(),
+			m_owner.getTimeStamp(m_owner.m_startTimeStamp), &ev);
 
-	return true;
+	// Perform the actual thread switch, back to the blocked thread numbers
+	if (nextThread != cur && nextThread >= 0 &&
+			(unsigned int)nextThread < m_runnableIndex.size())
+		m_curThread = m_runnableIndex[nextThread];
 }
 
-void Session::switchThread(const PtraceEvent &ev)
+void Session::setBlocked(IThread *thread, bool blocked)
 {
-	IPtrace &ptrace = IPtrace::getInstance();
-	int nextThread;
-	IThread *threads[m_nThreads];
-	int unblocked = 0;
-	int cur = -1;
+	std::map<IThread *, int>::iterator it = m_threadIndex.find(thread);
 
-	// Filter out unblocked threads
-	for (int i = 0; i < m_nThreads; i++) {
-		if (m_threads[i]->isBlocked())
-			continue;
+	// Not one of the threads of this session
+	if (it == m_threadIndex.end())
+		return;
 
-		threads[unblocked] = m_threads[i];
+	int which = it->second;
 
-		// Might not be the same
-		if (m_curThread == i)
-			cur = unblocked;
+	if (blocked)
+		thread->block();
+	else
+		thread->unBlock();
 
-		unblocked++;
-	}
+	if (isRunnable(which) == blocked)
+		m_nRunnable += blocked ? -1 : 1;
+	setRunnable(which, !blocked);
+}
 
-	nextThread = m_owner.m_selector->selectThread(cur,
-			threads, unblocked,
-			m_owner.getTimeStamp(m_owner.m_startTimeStamp), &ev);
+void Session::setRunnable(int which, bool runnable)
+{
+	unsigned long mask = 1UL << (which % BITS_PER_WORD);
 
-	// Perform the actual thread switch
-	if (nextThread != cur) {
+	if (runnable)
+		m_runnableBits[which / BITS_PER_WORD] |= mask;
+	else
+		m_runnableBits[which / BITS_PER_WORD] &= ~mask;
+}
 
-		// Convert back to the blocked thread numbers
-		for (int i = 0; i < m_nThreads; i++) {
-			if (m_threads[i] == threads[nextThread]) {
-				nextThread = i;
-				break;
-			}
-		}
+bool Session::isRunnable(int which)
+{
+	return (m_runnableBits[which / BITS_PER_WORD] >> (which % BITS_PER_WORD)) & 1;
+}
 
-		m_curThread = nextThread;
+// From the thread states, when the threads have been replaced
+void Session::rebuildRunnable()
+{
+	m_runnableBits.assign(m_nThreads / BITS_PER_WORD + 1, 0);
+	m_nRunnable = 0;
+	m_threadIndex.clear();
+
+	for (int i = 0; i < m_nThreads; i++) {
+		m_threadIndex[m_threads[i]] = i;
+		if (m_threads[i]->isBlocked())
+			continue;
+
+		setRunnable(i, true);
+		m_nRunnable++;
 	}
 }
 
@@ -640,7 +2343,11 @@ void Session::releaseLastThread()
 	IPtrace &ptrace = IPtrace::getInstance();
 
 	ptrace.clearAllBreakpoints();
-	ptrace.setBreakpoint((void *)Session::threadExit);
+	m_sites.clear();
+	m_hardwareSites.clear();
+
+	addSite(ptrace.setBreakpoint((void *)Session::threadExit),
+			(void *)Session::threadExit);
 
 	m_lastThreadLoose = true;
 }
@@ -667,6 +2374,19 @@ bool Session::continueExecution()
 	m_threads[m_curThread]->loadRegisters();
 	const PtraceEvent ev = IPtrace::getInstance().continueExecution();
 
+	return handleEvent(ev);
+}
+
+// Let the child run without waiting for it, the event comes via waitEvent
+bool Session::resume()
+{
+	m_threads[m_curThread]->loadRegisters();
+
+	return IPtrace::getInstance().resume();
+}
+
+bool Session::handleEvent(const PtraceEvent &ev)
+{
 	coin_debug(PTRACE_MSG, "PT event at %p: id/type: 0x%08x/%d\n",
 			ev.addr, ev.eventId, ev.type);
 
@@ -702,19 +2422,154 @@ bool Session::continueExecution()
 	return false;
 }
 
-bool Session::run()
+void Session::armBreakpoints()
 {
-	bool should_quit = false;
+	IPtrace &ptrace = IPtrace::getInstance();
+	std::vector<void *> addrs;
+	std::vector<int> ids(m_owner.m_breakpoints.size(), -1);
+
+	addrs.reserve(m_owner.m_breakpoints.size());
+	for (Controller::BreakpointMap_t::iterator it = m_owner.m_breakpoints.begin();
+			it != m_owner.m_breakpoints.end(); it++)
+		addrs.push_back(it->first);
+
+	// Arm all of them in one go, page by page
+	if (!addrs.empty() &&
+			!ptrace.setBreakpoints(&addrs[0], &ids[0], addrs.size()))
+		error("Can't set breakpoint!\n");
+
+	m_sites.clear();
+	for (unsigned int i = 0; i < addrs.size(); i++)
+		addSite(ids[i], addrs[i]);
+}
 
+/*
+ * Fork the child for this session. With the fork server, the breakpoints
+ * are only armed when the template is created, which is redone when new
+ * breakpoints have been found.
+ */
+int Session::forkChild()
+{
 	IPtrace &ptrace = IPtrace::getInstance();
-	/* Fork the parent process of all test threads. All
-	 * other threads will be threads running in this
-	 * context.
-	 *
-	 * For each round in the test, this is forked again
-	 * to retain the original memory state.
-	 */
-	m_curPid = ptrace.forkAndAttach();
+	int pid;
+
+	if (m_owner.m_forkServer && m_owner.m_breakpointsChanged) {
+		pid = ptrace.forkTemplate();
+		// In the template
+		if (pid == 0)
+			return pid;
+
+		if (pid < 0) {
+			error("Can't create the fork server template, disabling it\n");
+			m_owner.setForkServer(false);
+		} else {
+			armBreakpoints();
+			m_owner.m_breakpointsChanged = false;
+		}
+	}
+
+	if (m_owner.m_forkServer) {
+		pid = ptrace.forkFromTemplate();
+		if (pid > 0)
+			return pid;
+
+		error("Can't fork from template, disabling the fork server\n");
+		m_owner.setForkServer(false);
+	}
+
+	pid = ptrace.forkAndAttach();
+	if (pid > 0)
+		armBreakpoints();
+
+	return pid;
+}
+
+/*
+ * Continue from a checkpoint with the thread states at that point, and
+ * another thread than the ones selected there before.
+ */
+int Session::resumeCheckpoint(Controller::Checkpoint &cp)
+{
+	int pid = IPtrace::getInstance().forkFromCheckpoint(cp.pid);
+	unsigned int next;
+
+	if (pid <= 0)
+		return -1;
+
+	for (int i = 0; i < m_nThreads; i++)
+		ThreadFactory::releaseThread(*m_threads[i]);
+
+	m_nThreads = cp.threads.size();
+	m_threads.resize(m_nThreads);
+	for (int i = 0; i < m_nThreads; i++)
+		m_threads[i] = &ThreadFactory::restoreThread(*cp.threads[i]);
+	rebuildRunnable();
+
+	for (next = 0; next < cp.tried.size(); next++) {
+		if (!cp.tried[next])
+			break;
+	}
+	cp.tried[next] = true;
+	m_curThread = next;
+
+	coin_debug(INFO_MSG, "INFO: Resumed checkpoint %d with thread %d\n",
+			cp.pid, next);
+
+	return pid;
+}
+
+/*
+ * Checkpoint the child after a scheduling decision, so that the other
+ * choices can be explored without running the prefix again.
+ */
+void Session::maybeCheckpoint()
+{
+	if (m_owner.m_maxCheckpoints == 0 || m_lastThreadLoose ||
+			++m_decisions % CHECKPOINT_INTERVAL != 0)
+		return;
+
+	// Blocked threads and semaphores are kept here, not in the child
+	if (m_nRunnable != m_nThreads ||
+			!SemaphoreManager::getInstance().isIdle())
+		return;
+
+	int pid = IPtrace::getInstance().checkpoint();
+	if (pid < 0)
+		return;
+
+	Controller::Checkpoint *cp = new Controller::Checkpoint();
+
+	cp->pid = pid;
+	cp->tried.resize(m_nThreads, false);
+	cp->tried[m_curThread] = true;
+	for (int i = 0; i < m_nThreads; i++)
+		cp->threads.push_back(ThreadFactory::copyThread(*m_threads[i]));
+
+	m_owner.addCheckpoint(cp);
+}
+
+/*
+ * Fork the parent process of all test threads. All other threads will be
+ * threads running in this context.
+ *
+ * For each round in the test, this is forked again to retain the original
+ * memory state.
+ */
+bool Session::start(Controller::Checkpoint *cp)
+{
+	for (unsigned int i = 0; i < m_detectors.size(); i++)
+		m_detectors[i]->reset();
+
+	m_curPid = -1;
+	if (cp) {
+		m_curPid = resumeCheckpoint(*cp);
+		if (m_curPid < 0) {
+			m_owner.releaseCheckpoint(cp);
+			cp = NULL;
+		}
+	}
+	if (!cp)
+		m_curPid = forkChild();
 
 	if (m_curPid < 0) {
 		error("fork failed\n");
@@ -723,42 +2578,84 @@ bool Session::run()
 		// Hmm... Not sure what to do here
 		exit(0);
 	}
-	else {
-		// Parent
-		bool should_quit;
 
-		for (Controller::BreakpointMap_t::iterator it = m_owner.m_breakpoints.begin();
-				it != m_owner.m_breakpoints.end(); it++) {
-			void *p = it->first;
+	m_resumed = cp != NULL;
 
-			int id = ptrace.setBreakpoint(p);
-			if (id < 0)
-				error("Can't set breakpoint!\n");
-		}
+	return true;
+}
+
+/*
+ * Hand the run to the selector. With the pipeline, the session is started
+ * during the previous run, so this is done when it becomes the current one.
+ */
+void Session::beginRun()
+{
+	m_owner.m_selector->onRunStart(m_threads.empty() ? NULL : &m_threads[0],
+			m_nThreads);
 
-		// Select an initial thread and load its registers
-		m_curThread = m_owner.m_selector->selectThread(0, m_threads, m_nThreads,
+	// Select an initial thread, its registers are loaded when resuming
+	if (!m_resumed)
+		m_curThread = m_owner.m_selector->selectThread(0,
+				m_threads.empty() ? NULL : &m_threads[0], m_nThreads,
 				m_owner.getTimeStamp(m_owner.m_startTimeStamp), NULL);
+}
 
-		do {
-			should_quit = !continueExecution();
+// Check if the run should go on after an event has been handled
+bool Session::keepRunning(bool handled)
+{
+	if (!m_owner.m_error.empty())
+		return false;
 
-			if (!m_owner.m_error.empty())
-				break;
+	// Quit if all threads have exited cleanly
+	if (m_nThreads == 0)
+		return false;
 
-			// Quit if all threads have exited cleanly
-			if (m_nThreads == 0)
-				break;
+	// If there is only one thread left, let it loose to
+	// improve performance
+	if (m_owner.m_nThreads - m_nThreads == 1)
+		releaseLastThread();
+
+	return handled;
+}
+
+void Session::finish()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
 
-			// If there is only one thread left, let it loose to
-			// improve performance
-			if (m_owner.m_nThreads - m_nThreads == 1)
-				releaseLastThread();
-		} while (!should_quit);
+	// Before the restore check, since pruned sites change the breakpoints
+	if (m_owner.m_pruneRuns > 0)
+		m_owner.updateStoreProfile(m_siteShared);
+	m_siteShared.clear();
+	m_addressOwners.clear();
 
+	/*
+	 * Keep the child if it can be restored, unless the template will
+	 * be re-created anyway. With concurrent sessions or the pipeline, the
+	 * next child might be forked before this one is reused.
+	 */
+	if (!m_owner.m_snapshotRestore || m_owner.m_breakpointsChanged ||
+			m_owner.m_concurrentSessions > 1 || m_owner.m_pipeline ||
+			!ptrace.restoreChild())
 		ptrace.kill();
-		m_curPid = -1;
-	}
+	m_curPid = -1;
+	m_owner.m_phaseRuns++;
+}
+
+bool Session::run(Controller::Checkpoint *cp)
+{
+	uint64_t ts = m_owner.getTimeStamp(0);
+
+	if (!start(cp))
+		return false;
+	beginRun();
+	ts = m_owner.addPhaseTime(Controller::PHASE_SETUP, ts);
+
+	while (keepRunning(continueExecution()))
+		;
+	ts = m_owner.addPhaseTime(Controller::PHASE_RUN, ts);
+
+	finish();
+	m_owner.addPhaseTime(Controller::PHASE_TEARDOWN, ts);
 
 	return m_nThreads == 0;
 }
@@ -795,11 +2692,86 @@ void coincident_set_time_limit(int n_ms)
 	IController::getInstance().setTimeLimit(n_ms);
 }
 
+void coincident_set_fork_server(int enabled)
+{
+	IController::getInstance().setForkServer(enabled != 0);
+}
+
+void coincident_set_snapshot_restore(int enabled)
+{
+	IController::getInstance().setSnapshotRestore(enabled != 0);
+}
+
+void coincident_set_checkpoints(int max_checkpoints)
+{
+	IController::getInstance().setCheckpoints(max_checkpoints);
+}
+
+void coincident_set_stack_stores(int enabled)
+{
+	IController::getInstance().setStackStores(enabled != 0);
+}
+
+void coincident_set_store_pruning(int n_runs)
+{
+	IController::getInstance().setStorePruning(n_runs);
+}
+
+void coincident_set_happens_before(int enabled)
+{
+	IController::getInstance().setHappensBefore(enabled != 0);
+}
+
+void coincident_set_lockset(int enabled)
+{
+	IController::getInstance().setLockset(enabled != 0);
+}
+
+void coincident_set_atomicity(int enabled)
+{
+	IController::getInstance().setAtomicity(enabled != 0);
+}
+
+void coincident_set_guided_preemption(int enabled)
+{
+	IController::getInstance().setGuidedPreemption(enabled != 0);
+}
+
+void coincident_set_workers(int n_workers)
+{
+	IController::getInstance().setWorkers(n_workers);
+}
+
+void coincident_set_concurrent_sessions(int n_sessions)
+{
+	IController::getInstance().setConcurrentSessions(n_sessions);
+}
+
+void coincident_set_pipeline(int enabled)
+{
+	IController::getInstance().setPipeline(enabled != 0);
+}
+
+void coincident_set_stack_size(unsigned long n_bytes)
+{
+	ThreadFactory::setStackSize(n_bytes);
+}
+
 void coincident_set_bucket_selector(int *buckets, unsigned int n_buckets)
 {
 	IController::getInstance().setThreadSelector(new TimeListSelector(buckets, n_buckets));
 }
 
+void coincident_set_race_fuzzer(int collect_runs)
+{
+	IController::getInstance().setThreadSelector(new RaceFuzzerSelector(collect_runs));
+}
+
+void coincident_set_pct_selector(int depth)
+{
+	IController::getInstance().setThreadSelector(new PctSelector(depth));
+}
+
 int coincident_run(void)
 {
 	if (IController::getInstance().run() == false)
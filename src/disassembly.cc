@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <udis86.h>
 
 #include <disassembly.hh>
@@ -17,7 +18,8 @@ public:
 		ud_init(&m_ud);
 
 		ud_set_user_opaque_data(&m_ud, (void *)this);
-		ud_set_mode(&m_ud, 32);
+		// The same mode as the tracer, since the child is a fork of it
+		ud_set_mode(&m_ud, sizeof(void *) * 8);
 
 		m_data = NULL;
 		m_dataSize = 0;
@@ -48,31 +50,15 @@ public:
 
 			bool call = m_ud.mnemonic == UD_Icall;
 
-			bool branch = m_ud.mnemonic == UD_Ijo ||
-					m_ud.mnemonic == UD_Ijno ||
-					m_ud.mnemonic == UD_Ijb ||
-					m_ud.mnemonic == UD_Ijae ||
-					m_ud.mnemonic == UD_Ijz ||
-					m_ud.mnemonic == UD_Ijnz ||
-					m_ud.mnemonic == UD_Ijbe ||
-					m_ud.mnemonic == UD_Ija ||
-					m_ud.mnemonic == UD_Ijs ||
-					m_ud.mnemonic == UD_Ijns ||
-					m_ud.mnemonic == UD_Ijp ||
-					m_ud.mnemonic == UD_Ijnp ||
-					m_ud.mnemonic == UD_Ijl ||
-					m_ud.mnemonic == UD_Ijge ||
-					m_ud.mnemonic == UD_Ijle ||
-					m_ud.mnemonic == UD_Ijg ||
-					m_ud.mnemonic == UD_Ijcxz ||
-					m_ud.mnemonic == UD_Ijecxz ||
-					m_ud.mnemonic == UD_Ijrcxz ||
-					m_ud.mnemonic == UD_Ijmp;
-
-
-			if (mem)
-				listener->onMemoryReference(ud_insn_off(&m_ud),
-						m_ud.operand[1].type == UD_OP_MEM);
+			bool branch = isBranch();
+
+
+			if (mem) {
+				bool isLoad = m_ud.operand[1].type == UD_OP_MEM;
+
+				listener->onMemoryReference(ud_insn_off(&m_ud), isLoad,
+						isStackLocal(m_ud.operand[isLoad ? 1 : 0]));
+			}
 
 			if (call)
 				listener->onCall(ud_insn_off(&m_ud));
@@ -84,7 +70,181 @@ public:
 		return true;
 	}
 
+	bool decode(IDisassembly::Instruction &out, const uint8_t *data, size_t size)
+	{
+		if (!data || size == 0)
+			return false;
+
+		ud_set_pc(&m_ud, 0);
+
+		m_data = (uint8_t *)data;
+		m_dataSize = size;
+		m_count = 0;
+
+		ud_set_input_hook(&m_ud, next_byte);
+
+		if (ud_disassemble(&m_ud) == 0 || m_ud.mnemonic == UD_Iinvalid)
+			return false;
+
+		out.size = ud_insn_len(&m_ud);
+		out.isControlTransfer = isBranch() ||
+				m_ud.mnemonic == UD_Icall ||
+				m_ud.mnemonic == UD_Iret ||
+				m_ud.mnemonic == UD_Iretf ||
+				m_ud.mnemonic == UD_Iint3 ||
+				m_ud.mnemonic == UD_Iint ||
+				m_ud.mnemonic == UD_Iinto ||
+				m_ud.mnemonic == UD_Iiretw ||
+				m_ud.mnemonic == UD_Iiretd ||
+				m_ud.mnemonic == UD_Iloop ||
+				m_ud.mnemonic == UD_Iloope ||
+				m_ud.mnemonic == UD_Iloopnz ||
+				m_ud.mnemonic == UD_Isyscall ||
+				m_ud.mnemonic == UD_Isysenter;
+		out.isPcRelative = (isPcRelative(m_ud.operand[0]) ||
+				isPcRelative(m_ud.operand[1]) ||
+				isPcRelative(m_ud.operand[2]));
+		out.isMove = m_ud.mnemonic == UD_Imov;
+		out.isAddressOnly = m_ud.mnemonic == UD_Ilea ||
+				m_ud.mnemonic == UD_Inop;
+		out.hasSegmentPrefix = m_ud.pfx_seg != 0;
+
+		convertOperand(out.operands[0], m_ud.operand[0]);
+		convertOperand(out.operands[1], m_ud.operand[1]);
+
+		return true;
+	}
+
 private:
+	// 32- or 64-bit general purpose register number, or -1
+	int gpr(enum ud_type reg)
+	{
+		if (reg >= UD_R_EAX && reg <= UD_R_R15D)
+			return reg - UD_R_EAX;
+		if (reg >= UD_R_RAX && reg <= UD_R_R15)
+			return reg - UD_R_RAX;
+
+		return -1;
+	}
+
+	/*
+	 * Relative to esp/ebp (rsp/rbp). This assumes that ebp is the frame
+	 * pointer, which isn't true with -fomit-frame-pointer.
+	 */
+	bool isStackLocal(const struct ud_operand &op)
+	{
+		int base = gpr(op.base);
+
+		return op.type == UD_OP_MEM && (base == 4 || base == 5);
+	}
+
+	// Branch targets and RIP-relative memory operands
+	bool isPcRelative(const struct ud_operand &op)
+	{
+		return op.type == UD_OP_JIMM ||
+				(op.type == UD_OP_MEM && op.base == UD_R_RIP);
+	}
+
+	void convertOperand(IDisassembly::Operand &out, const struct ud_operand &op)
+	{
+		memset(&out, 0, sizeof(out));
+		out.reg = -1;
+		out.base = -1;
+		out.index = -1;
+		out.size = op.size / 8;
+
+		switch (op.type) {
+		case UD_NONE:
+			out.type = IDisassembly::Operand::OP_NONE;
+			break;
+		case UD_OP_REG:
+			out.type = IDisassembly::Operand::OP_REGISTER;
+			if (op.base >= UD_R_AL && op.base <= UD_R_BL) {
+				out.reg = op.base - UD_R_AL;
+				out.size = 1;
+			} else if (op.base >= UD_R_AH && op.base <= UD_R_BH) {
+				out.reg = op.base - UD_R_AH;
+				out.highByte = true;
+				out.size = 1;
+			} else if (op.base >= UD_R_SPL && op.base <= UD_R_R15B) {
+				// With a REX prefix
+				out.reg = op.base - UD_R_SPL + 4;
+				out.size = 1;
+			} else if (op.base >= UD_R_AX && op.base <= UD_R_R15W) {
+				out.reg = op.base - UD_R_AX;
+				out.size = 2;
+			} else {
+				out.reg = gpr(op.base);
+				out.size = op.base >= UD_R_RAX ? 8 : 4;
+			}
+
+			if (out.reg < 0)
+				out.type = IDisassembly::Operand::OP_OTHER;
+			break;
+		case UD_OP_IMM:
+			out.type = IDisassembly::Operand::OP_IMMEDIATE;
+			if (op.size == 8)
+				out.immediate = op.lval.ubyte;
+			else if (op.size == 16)
+				out.immediate = op.lval.uword;
+			else if (op.size == 64)
+				out.immediate = op.lval.uqword;
+			else
+				out.immediate = (long)op.lval.sdword; // Sign-extended for 64-bit stores
+			break;
+		case UD_OP_MEM:
+			out.type = IDisassembly::Operand::OP_MEMORY;
+			out.base = gpr(op.base);
+			out.index = gpr(op.index);
+			out.scale = op.scale ? op.scale : 1;
+			out.pcRelative = op.base == UD_R_RIP;
+
+			if (op.offset == 8)
+				out.displacement = op.lval.sbyte;
+			else if (op.offset == 16)
+				out.displacement = op.lval.sword;
+			else if (op.offset == 32)
+				out.displacement = op.lval.sdword;
+			else if (op.offset == 64)
+				out.displacement = op.lval.sqword;
+
+			// Only native addressing, i.e., not with an address size prefix
+			if ((op.base != UD_NONE && out.base < 0 && !out.pcRelative) ||
+					(op.index != UD_NONE && out.index < 0) ||
+					m_ud.adr_mode != sizeof(void *) * 8 ||
+					op.offset == 16)
+				out.type = IDisassembly::Operand::OP_OTHER;
+			break;
+		default:
+			out.type = IDisassembly::Operand::OP_OTHER;
+			break;
+		}
+	}
+
+	bool isBranch()
+	{
+		return m_ud.mnemonic == UD_Ijo ||
+				m_ud.mnemonic == UD_Ijno ||
+				m_ud.mnemonic == UD_Ijb ||
+				m_ud.mnemonic == UD_Ijae ||
+				m_ud.mnemonic == UD_Ijz ||
+				m_ud.mnemonic == UD_Ijnz ||
+				m_ud.mnemonic == UD_Ijbe ||
+				m_ud.mnemonic == UD_Ija ||
+				m_ud.mnemonic == UD_Ijs ||
+				m_ud.mnemonic == UD_Ijns ||
+				m_ud.mnemonic == UD_Ijp ||
+				m_ud.mnemonic == UD_Ijnp ||
+				m_ud.mnemonic == UD_Ijl ||
+				m_ud.mnemonic == UD_Ijge ||
+				m_ud.mnemonic == UD_Ijle ||
+				m_ud.mnemonic == UD_Ijg ||
+				m_ud.mnemonic == UD_Ijcxz ||
+				m_ud.mnemonic == UD_Ijecxz ||
+				m_ud.mnemonic == UD_Ijrcxz ||
+				m_ud.mnemonic == UD_Ijmp;
+	}
+
 	int nextUdByte()
 	{
 		if (m_count == m_dataSize)
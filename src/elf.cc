@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <libelf.h>
+#include <gelf.h>
 #include <map>
 #include <string>
 
@@ -75,6 +76,8 @@ public:
 
 		m_loadList.clear();
 		m_storeList.clear();
+		m_stackLoadList.clear();
+		m_stackStoreList.clear();
 
 		m_refsValid = true;
 		if (!res) {
@@ -93,6 +96,14 @@ public:
 		return m_loadList;
 	}
 
+	ReferenceList_t &getStackMemoryLoads()
+	{
+		if (!m_refsValid)
+			disassembleFunction();
+
+		return m_stackLoadList;
+	}
+
 	ReferenceList_t &getMemoryStores()
 	{
 		if (!m_refsValid)
@@ -101,13 +112,25 @@ public:
 		return m_storeList;
 	}
 
+	ReferenceList_t &getStackMemoryStores()
+	{
+		if (!m_refsValid)
+			disassembleFunction();
+
+		return m_stackStoreList;
+	}
+
 	// These three functions are the IInstructionListerners
-	void onMemoryReference(off_t offset, bool isLoad)
+	void onMemoryReference(off_t offset, bool isLoad, bool isStackLocal)
 	{
 		off_t addr = (off_t)m_entry + offset;
 
-		if (isLoad)
+		if (isLoad && isStackLocal)
+			m_stackLoadList.push_back((void *)addr);
+		else if (isLoad)
 			m_loadList.push_back((void *)addr);
+		else if (isStackLocal)
+			m_stackStoreList.push_back((void *)addr);
 		else
 			m_storeList.push_back((void *)addr);
 	}
@@ -130,6 +153,8 @@ private:
 
 	ReferenceList_t m_loadList;
 	ReferenceList_t m_storeList;
+	ReferenceList_t m_stackLoadList;
+	ReferenceList_t m_stackStoreList;
 };
 
 class Elf : public IElf
@@ -149,6 +174,7 @@ public:
 
 	bool checkFile()
 	{
+		GElf_Ehdr ehdr;
 		Elf *elf;
 		bool out = true;
 		int fd;
@@ -164,8 +190,8 @@ public:
 				out = false;
 				goto out_open;
 		}
-		if (!elf32_getehdr(elf)) {
-				error("elf32_getehdr failed on %s\n", m_filename);
+		if (!gelf_getehdr(elf, &ehdr)) {
+				error("gelf_getehdr failed on %s\n", m_filename);
 				out = false;
 		}
 		elf_end(elf);
@@ -209,9 +235,10 @@ out_open:
 			if (cur->p_type != PT_LOAD)
 				continue;
 
-			coin_debug(ELF_MSG, "ELF seg 0x%08x -> 0x%08x...0x%08x\n",
-					cur->p_paddr, info->dlpi_addr + cur->p_vaddr,
-					info->dlpi_addr + cur->p_vaddr + cur->p_memsz);
+			coin_debug(ELF_MSG, "ELF seg 0x%08lx -> 0x%08lx...0x%08lx\n",
+					(unsigned long)cur->p_paddr,
+					(unsigned long)(info->dlpi_addr + cur->p_vaddr),
+					(unsigned long)(info->dlpi_addr + cur->p_vaddr + cur->p_memsz));
 			m_curSegments.push_back(Segment(cur->p_paddr, info->dlpi_addr + cur->p_vaddr,
 					cur->p_memsz, cur->p_align));
 		}
@@ -239,7 +266,7 @@ out_open:
 	bool parseOne(IFunctionListener *listener)
 	{
 		Elf_Scn *scn = NULL;
-		Elf32_Ehdr *ehdr;
+		GElf_Ehdr ehdr;
 		size_t shstrndx;
 		bool ret = false;
 		int fd;
@@ -258,8 +285,8 @@ out_open:
 		}
 
 
-		if (!(ehdr = elf32_getehdr(m_elf))) {
-				error("elf32_getehdr failed on %s\n", m_filename);
+		if (!gelf_getehdr(m_elf, &ehdr)) {
+				error("gelf_getehdr failed on %s\n", m_filename);
 				goto out_elf_begin;
 		}
 
@@ -270,11 +297,12 @@ out_open:
 
 		while ( (scn = elf_nextscn(m_elf, scn)) != NULL )
 		{
-			Elf32_Shdr *shdr = elf32_getshdr(scn);
+			GElf_Shdr shdr;
 			Elf_Data *data = elf_getdata(scn, NULL);
 			char *name;
 
-			name = elf_strptr(m_elf, shstrndx, shdr->sh_name);
+			gelf_getshdr(scn, &shdr);
+			name = elf_strptr(m_elf, shstrndx, shdr.sh_name);
 			if(!data) {
 					error("elf_getdata failed on section %s in %s\n",
 							name, m_filename);
@@ -282,9 +310,9 @@ out_open:
 			}
 
 			/* Handle symbols */
-			if (shdr->sh_type == SHT_SYMTAB)
+			if (shdr.sh_type == SHT_SYMTAB)
 				handleSymtab(scn);
-			if (shdr->sh_type == SHT_DYNSYM)
+			if (shdr.sh_type == SHT_DYNSYM)
 				handleDynsym(scn);
 		}
 		elf_end(m_elf);
@@ -294,11 +322,15 @@ out_open:
 		}
 		while ( (scn = elf_nextscn(m_elf, scn)) != NULL )
 		{
-			Elf32_Shdr *shdr = elf32_getshdr(scn);
-			char *name = elf_strptr(m_elf, shstrndx, shdr->sh_name);
+			GElf_Shdr shdr;
+			char *name;
+
+			gelf_getshdr(scn, &shdr);
+			name = elf_strptr(m_elf, shstrndx, shdr.sh_name);
 
-			// .rel.plt
-			if (shdr->sh_type == SHT_REL && strcmp(name, ".rel.plt") == 0)
+			// .rel.plt on ia32, .rela.plt on x86_64
+			if ((shdr.sh_type == SHT_REL && strcmp(name, ".rel.plt") == 0) ||
+					(shdr.sh_type == SHT_RELA && strcmp(name, ".rela.plt") == 0))
 				handleRelPlt(scn);
 		}
 		m_fixupFunctions.clear();
@@ -350,7 +382,7 @@ private:
 	typedef std::map<int, Function *> FixupMap_t;
 	typedef std::list<Segment> SegmentList_t;
 
-	void *offsetTableToAddress(Elf32_Addr addr)
+	void *offsetTableToAddress(ElfW(Addr) addr)
 	{
 		/*
 		 * The .got.plt table contains a pointer to the push instruction
@@ -361,7 +393,8 @@ private:
 		 *   8070f16:       68 b0 06 00 00          push   $0x6b0
 		 *
 		 * so to get the entry point, we rewind the pointer to the start
-		 * of the jmp.
+		 * of the jmp. The jmp is RIP-relative on x86_64, but has the
+		 * same size.
 		 */
 		return (void *)(addr - 6);
 	}
@@ -383,19 +416,38 @@ private:
 
 	void handleRelPlt(Elf_Scn *scn)
 	{
-		Elf32_Shdr *shdr = elf32_getshdr(scn);
+		GElf_Shdr shdr;
 		Elf_Data *data = elf_getdata(scn, NULL);
-		Elf32_Rel *r = (Elf32_Rel *)data->d_buf;
-		int n = data->d_size / sizeof(Elf32_Rel);
+		int n;
+
+		gelf_getshdr(scn, &shdr);
+		n = shdr.sh_entsize ? data->d_size / shdr.sh_entsize : 0;
 
 		panic_if(n <= 0,
 				"Section data too small (%zd) - no symbols\n",
 				data->d_size);
 
-		for (int i = 0; i < n; i++, r++) {
-			Elf32_Addr *got_plt = (Elf32_Addr *)adjustAddressBySegment(r->r_offset);
+		for (int i = 0; i < n; i++) {
+			GElf_Addr offset;
+			GElf_Xword info;
+
+			if (shdr.sh_type == SHT_RELA) {
+				GElf_Rela r;
+
+				gelf_getrela(data, i, &r);
+				offset = r.r_offset;
+				info = r.r_info;
+			} else {
+				GElf_Rel r;
+
+				gelf_getrel(data, i, &r);
+				offset = r.r_offset;
+				info = r.r_info;
+			}
+
+			ElfW(Addr) *got_plt = (ElfW(Addr) *)adjustAddressBySegment(offset);
 
-			FixupMap_t::iterator it = m_fixupFunctions.find(ELF32_R_SYM(r->r_info));
+			FixupMap_t::iterator it = m_fixupFunctions.find(GELF_R_SYM(info));
 
 			if (it == m_fixupFunctions.end())
 				continue;
@@ -419,13 +471,15 @@ private:
 
 	void handleSymtabGeneric(Elf_Scn *scn, enum IFunction::FunctionType symType)
 	{
-		Elf32_Shdr *shdr = elf32_getshdr(scn);
+		GElf_Shdr shdr;
 		Elf_Data *data = elf_getdata(scn, NULL);
-		Elf32_Sym *s = (Elf32_Sym *)data->d_buf;
 		int n_syms = 0;
 		int n_fns = 0;
 		int n_datas = 0;
-		int n = data->d_size / sizeof(Elf32_Sym);
+		int n;
+
+		gelf_getshdr(scn, &shdr);
+		n = shdr.sh_entsize ? data->d_size / shdr.sh_entsize : 0;
 
 		panic_if(n <= 0,
 				"Section data too small (%zd) - no symbols\n",
@@ -434,24 +488,26 @@ private:
 		/* Iterate through all symbols */
 		for (int i = 0; i < n; i++)
 		{
-			const char *sym_name = elf_strptr(m_elf, shdr->sh_link, s->st_name);
-			int type = ELF32_ST_TYPE(s->st_info);
+			GElf_Sym s;
+
+			gelf_getsym(data, i, &s);
+
+			const char *sym_name = elf_strptr(m_elf, shdr.sh_link, s.st_name);
+			int type = GELF_ST_TYPE(s.st_info);
 
 			/* Ohh... This is an interesting symbol, add it! */
 			if ( type == STT_FUNC) {
-				Elf32_Addr addr = adjustAddressBySegment(s->st_value);
-				Elf32_Word size = s->st_size;
+				ElfW(Addr) addr = adjustAddressBySegment(s.st_value);
+				size_t size = s.st_size;
 				Function *fn = new Function(sym_name, (void *)addr, size, symType);
 
 				m_functionsByName[std::string(sym_name)].push_back(fn);
 				// Needs fixup?
-				if (shdr->sh_type == SHT_DYNSYM && size == 0)
+				if (shdr.sh_type == SHT_DYNSYM && size == 0)
 					m_fixupFunctions[i] = fn;
 				else
 					m_functionsByAddress[(void *)addr] = fn;
 			}
-
-			s++;
 		}
 	}
 
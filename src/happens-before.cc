@@ -0,0 +1,306 @@
+#include <detector.hh>
+#include <shadow-memory.hh>
+#include <utils.hh>
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+
+using namespace coincident;
+
+/*
+ * FastTrack-style detector: each thread and lock has a vector clock, and
+ * each word remembers its last write and its reads as epochs (a clock
+ * value of one thread). Reads only need a full vector clock when several
+ * threads read concurrently, which is kept in a side table so the
+ * shadow entries stay fixed-size.
+ */
+class HappensBefore : public IDetector
+{
+public:
+	HappensBefore()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		m_threadIds.clear();
+		m_clocks.clear();
+		m_lockClocks.clear();
+		m_shadow.clear();
+		m_readShared.clear();
+		m_freeReadShared.clear();
+		m_report.clear();
+	}
+
+	bool onAccess(IThread *thread, void *site,
+			void *addr, size_t size, bool isStore)
+	{
+		int tid = getThreadId(thread);
+
+		for_each_word(word, addr, size) {
+			Shadow &shadow = m_shadow.lookup(word);
+			bool race;
+
+			if (isStore)
+				race = checkWrite(tid, site, word, shadow);
+			else
+				race = checkRead(tid, site, word, shadow);
+
+			// One report per access is enough
+			if (race)
+				return true;
+		}
+
+		return false;
+	}
+
+	void onAcquire(IThread *thread, const void *object)
+	{
+		int tid = getThreadId(thread);
+		LockClockMap_t::iterator it = m_lockClocks.find(object);
+
+		if (it != m_lockClocks.end())
+			join(m_clocks[tid], it->second);
+	}
+
+	void onRelease(IThread *thread, const void *object)
+	{
+		int tid = getThreadId(thread);
+
+		// Semaphores can be signalled by several threads, so join
+		join(m_lockClocks[object], m_clocks[tid]);
+		m_clocks[tid][tid]++;
+	}
+
+	// Ordering comes through onAcquire/onRelease from the semaphore
+	void onLock(IThread *thread, const void *lock)
+	{
+	}
+
+	void onUnlock(IThread *thread, const void *lock)
+	{
+	}
+
+	bool wantsPreemption()
+	{
+		return false;
+	}
+
+	const char *getReport()
+	{
+		return m_report.c_str();
+	}
+
+private:
+	typedef std::vector<unsigned int> VectorClock_t;
+
+	// Clock value of one thread, clock 0 is "never"
+	class Epoch
+	{
+	public:
+		Epoch() : tid(0), clock(0)
+		{
+		}
+
+		int tid;
+		unsigned int clock;
+	};
+
+	// All zero when the word hasn't been accessed
+	class Shadow
+	{
+	public:
+		Epoch write;
+		void *writeSite;
+
+		// The last read, unless the reads are in readShared
+		Epoch read;
+		void *readSite;
+		uint32_t readShared; // Index + 1 in m_readShared, 0 for none
+	};
+
+	// All concurrent reads of a word
+	class ReadShared
+	{
+	public:
+		VectorClock_t clocks;
+		std::vector<void *> sites;
+	};
+
+	typedef std::map<IThread *, int> ThreadIdMap_t;
+	typedef std::map<const void *, VectorClock_t> LockClockMap_t;
+
+	int getThreadId(IThread *thread)
+	{
+		ThreadIdMap_t::iterator it = m_threadIds.find(thread);
+
+		if (it != m_threadIds.end())
+			return it->second;
+
+		int tid = m_clocks.size();
+
+		m_threadIds[thread] = tid;
+		m_clocks.push_back(VectorClock_t(tid + 1, 0));
+		m_clocks[tid][tid] = 1;
+
+		return tid;
+	}
+
+	static unsigned int get(const VectorClock_t &vc, int tid)
+	{
+		return (unsigned int)tid < vc.size() ? vc[tid] : 0;
+	}
+
+	static void join(VectorClock_t &dst, const VectorClock_t &src)
+	{
+		if (dst.size() < src.size())
+			dst.resize(src.size(), 0);
+
+		for (unsigned int i = 0; i < src.size(); i++) {
+			if (src[i] > dst[i])
+				dst[i] = src[i];
+		}
+	}
+
+	// The epoch happened before the current point of thread tid
+	bool happensBefore(const Epoch &e, int tid)
+	{
+		return e.clock <= get(m_clocks[tid], e.tid);
+	}
+
+	bool checkRead(int tid, void *site, unsigned long addr, Shadow &shadow)
+	{
+		const VectorClock_t &clock = m_clocks[tid];
+		unsigned int now = clock[tid];
+
+		// Same epoch, already checked
+		if (!shadow.readShared && shadow.read.tid == tid && shadow.read.clock == now)
+			return false;
+
+		if (shadow.write.clock != 0 && shadow.write.tid != tid &&
+				!happensBefore(shadow.write, tid))
+			return reportRace(addr, "write", shadow.writeSite, shadow.write.tid,
+					"read", site, tid);
+
+		if (shadow.readShared) {
+			addRead(m_readShared[shadow.readShared - 1], tid, now, site);
+		} else if (shadow.read.clock == 0 || shadow.read.tid == tid ||
+				happensBefore(shadow.read, tid)) {
+			shadow.read.tid = tid;
+			shadow.read.clock = now;
+			shadow.readSite = site;
+		} else {
+			// Concurrent with the last read, keep both
+			shadow.readShared = allocateReadShared();
+
+			ReadShared &reads = m_readShared[shadow.readShared - 1];
+
+			addRead(reads, shadow.read.tid, shadow.read.clock, shadow.readSite);
+			addRead(reads, tid, now, site);
+		}
+
+		return false;
+	}
+
+	bool checkWrite(int tid, void *site, unsigned long addr, Shadow &shadow)
+	{
+		const VectorClock_t &clock = m_clocks[tid];
+		unsigned int now = clock[tid];
+
+		// Same epoch, already checked
+		if (shadow.write.tid == tid && shadow.write.clock == now) {
+			shadow.writeSite = site;
+			return false;
+		}
+
+		if (shadow.write.clock != 0 && shadow.write.tid != tid &&
+				!happensBefore(shadow.write, tid))
+			return reportRace(addr, "write", shadow.writeSite, shadow.write.tid,
+					"write", site, tid);
+
+		if (shadow.readShared) {
+			const ReadShared &reads = m_readShared[shadow.readShared - 1];
+
+			for (unsigned int other = 0; other < reads.clocks.size(); other++) {
+				if ((int)other == tid || reads.clocks[other] <= get(clock, other))
+					continue;
+
+				return reportRace(addr, "read", reads.sites[other], other,
+						"write", site, tid);
+			}
+		} else if (shadow.read.clock != 0 && shadow.read.tid != tid &&
+				!happensBefore(shadow.read, tid)) {
+			return reportRace(addr, "read", shadow.readSite, shadow.read.tid,
+					"write", site, tid);
+		}
+
+		// Later reads are ordered after this write, so forget the old ones
+		if (shadow.readShared) {
+			m_freeReadShared.push_back(shadow.readShared - 1);
+			shadow.readShared = 0;
+		}
+		shadow.read = Epoch();
+		shadow.write.tid = tid;
+		shadow.write.clock = now;
+		shadow.writeSite = site;
+
+		return false;
+	}
+
+	// @return the index + 1 of an empty entry in m_readShared
+	uint32_t allocateReadShared()
+	{
+		if (m_freeReadShared.empty()) {
+			m_readShared.push_back(ReadShared());
+
+			return m_readShared.size();
+		}
+
+		uint32_t out = m_freeReadShared.back();
+
+		m_freeReadShared.pop_back();
+		m_readShared[out].clocks.clear();
+		m_readShared[out].sites.clear();
+
+		return out + 1;
+	}
+
+	static void addRead(ReadShared &reads, int tid, unsigned int clock, void *site)
+	{
+		if (reads.clocks.size() <= (unsigned int)tid) {
+			reads.clocks.resize(tid + 1, 0);
+			reads.sites.resize(tid + 1, NULL);
+		}
+		reads.clocks[tid] = clock;
+		reads.sites[tid] = site;
+	}
+
+	bool reportRace(unsigned long addr, const char *firstType, void *firstSite, int firstTid,
+			const char *secondType, void *secondSite, int secondTid)
+	{
+		char buf[256];
+
+		snprintf(buf, sizeof(buf),
+				"Data race on 0x%08lx: %s at %p (thread %d) and %s at %p (thread %d) are unordered",
+				addr, firstType, firstSite, firstTid, secondType, secondSite, secondTid);
+		m_report = buf;
+
+		return true;
+	}
+
+	ThreadIdMap_t m_threadIds;
+	std::vector<VectorClock_t> m_clocks;
+	LockClockMap_t m_lockClocks;
+	ShadowMemory<Shadow> m_shadow;
+	std::vector<ReadShared> m_readShared;
+	std::vector<uint32_t> m_freeReadShared;
+	std::string m_report;
+};
+
+IDetector *IDetector::createHappensBefore()
+{
+	return new HappensBefore();
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+namespace coincident
+{
+	/**
+	 * Breakpoint bookkeeping for the ptrace layer.
+	 *
+	 * Breakpoints are kept in a dense vector indexed by the breakpoint ID,
+	 * and an open-addressing hash table maps addresses to IDs. The hash
+	 * slots also hold the original instruction byte, so the lookups done
+	 * on every trap touch a single cache line in the common case.
+	 */
+	class BreakpointTable
+	{
+	public:
+		class Slot
+		{
+		public:
+			unsigned long addr; // 0 for an empty slot
+			int id;
+			uint8_t instruction;
+			bool hardware; // In a debug register instead of an int3
+		};
+
+		BreakpointTable();
+
+
+		/**
+		 * Add a breakpoint
+		 *
+		 * @param addr the address of the breakpoint
+		 * @param instruction the original instruction byte at @a addr
+		 *
+		 * @return the ID of the new breakpoint
+		 */
+		int insert(void *addr, uint8_t instruction);
+
+		/**
+		 * Remove a breakpoint
+		 *
+		 * @param id the breakpoint to remove
+		 *
+		 * @return true if the breakpoint existed
+		 */
+		bool erase(int id);
+
+		/**
+		 * Remove all breakpoints and restart the IDs from 0
+		 */
+		void clear();
+
+		/**
+		 * Exchange the contents with another table without copying
+		 *
+		 * @param other the table to swap with
+		 */
+		void swap(BreakpointTable &other);
+
+		/**
+		 * Mark a breakpoint as set in a hardware debug register
+		 *
+		 * @param id the breakpoint
+		 * @param hardware true if set in a debug register, false for int3
+		 */
+		void setHardware(int id, bool hardware);
+
+
+		/**
+		 * Lookup a breakpoint by address
+		 *
+		 * @return the hash slot of the breakpoint, or NULL if there is none
+		 */
+		const Slot *lookup(void *addr) const
+		{
+			unsigned long key = (unsigned long)addr;
+			unsigned int i = hash(key);
+
+			while (1) {
+				const Slot *cur = &m_slots[i];
+
+				if (cur->addr == key)
+					return cur;
+				if (cur->addr == 0)
+					return NULL;
+
+				i = (i + 1) & m_mask;
+			}
+		}
+
+		/**
+		 * Lookup a breakpoint address by ID
+		 *
+		 * @return the address, or NULL if there is no such breakpoint
+		 */
+		void *getAddress(int id) const
+		{
+			if (id < 0 || (unsigned int)id >= m_addresses.size())
+				return NULL;
+
+			return m_addresses[id];
+		}
+
+		/**
+		 * @return the number of IDs handed out since the last clear
+		 */
+		unsigned int getIdCount() const
+		{
+			return m_addresses.size();
+		}
+
+		/**
+		 * @return the number of breakpoints currently in the table
+		 */
+		unsigned int size() const
+		{
+			return m_used;
+		}
+
+	private:
+		unsigned int hash(unsigned long key) const
+		{
+			uint64_t k = key;
+
+			// Fibonacci hashing, the low bits of addresses are not very random
+			k ^= k >> 32;
+
+			return ((uint32_t)k * 2654435761U) >> m_shift;
+		}
+
+		void resize(unsigned int capacity);
+
+		void insertSlot(const Slot &slot);
+
+		std::vector<void *> m_addresses;
+		std::vector<Slot> m_slots;
+		unsigned int m_mask;
+		unsigned int m_shift;
+		unsigned int m_used;
+	};
+}
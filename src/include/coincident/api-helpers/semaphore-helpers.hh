@@ -11,10 +11,23 @@ namespace coincident
 	public:
 		static SemaphoreManager &getInstance();
 
+		/**
+		 * Use another set of semaphores, e.g., those of the session being
+		 * handled when several sessions run at the same time
+		 *
+		 * @param instance the semaphores to use, NULL for the default ones
+		 */
+		static void setInstance(SemaphoreManager *instance);
+
 		Semaphore *getSem(unsigned long addr);
 
 		void clearSemaphores();
 
+		/**
+		 * @return true if no semaphore is taken or waited for
+		 */
+		bool isIdle();
+
 	private:
 		typedef std::map<unsigned long, Semaphore *> SemaphoreMap_t;
 
@@ -15,11 +15,17 @@ namespace coincident
 
 		bool tryWait();
 
+		/**
+		 * @return true if the semaphore is at its start value without waiters
+		 */
+		bool isIdle();
+
 	private:
 		typedef std::list<IThread *> WaitList_t;
 
 		WaitList_t m_waitList;
 		int m_value;
 		int m_maxValue;
+		int m_startValue;
 	};
 }
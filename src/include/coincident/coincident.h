@@ -38,6 +38,173 @@ extern void coincident_set_run_limit(int n_runs);
  */
 extern void coincident_set_time_limit(int n_ms);
 
+/**
+ * Run in parallel on multiple CPUs
+ *
+ * Each worker is a forked process pinned to its own CPU, which runs
+ * sessions until the shared run or time limit is reached. The first
+ * error stops all workers.
+ *
+ * @param n_workers the number of workers, 1 (the default) to run serially
+ */
+extern void coincident_set_workers(int n_workers);
+
+/**
+ * Run several sessions at the same time in each process
+ *
+ * One tracer drives all of them, and handles the stops of the other
+ * children while one is running. Combines with coincident_set_workers.
+ * Children are always killed after the run in this mode, i.e., snapshot
+ * restore is not used.
+ *
+ * @param n_sessions the number of sessions, 1 (the default) for one at a time
+ */
+extern void coincident_set_concurrent_sessions(int n_sessions);
+
+/**
+ * Prepare the next run while the current one is running
+ *
+ * The child of the next run is forked and its breakpoints armed while the
+ * current child runs, which hides the fork latency. Like with concurrent
+ * sessions, snapshot restore is not used. The time spent in each phase of
+ * the runs is printed with the INFO debug mask.
+ *
+ * @param enabled non-zero to enable the pipeline
+ */
+extern void coincident_set_pipeline(int enabled);
+
+/**
+ * Set the stack size of the test threads
+ *
+ * The stacks are only committed as the threads use them, so a large size
+ * costs address space but not memory. Set this before the first run, since
+ * stacks created after the fork server template don't exist in its
+ * children.
+ *
+ * @param n_bytes the stack size, 8 MB by default
+ */
+extern void coincident_set_stack_size(unsigned long n_bytes);
+
+/**
+ * Use a fork server for the runs
+ *
+ * A template process with all breakpoints armed is forked once, and each
+ * run then forks a copy of it. This makes the setup cost per run constant
+ * instead of proportional to the number of breakpoints.
+ *
+ * @param enabled non-zero to enable the fork server, 0 to disable it
+ */
+extern void coincident_set_fork_server(int enabled);
+
+/**
+ * Restore the child between runs instead of forking a new one
+ *
+ * The pages written during a run are found through the soft-dirty bits
+ * and copied back from the fork server template, which this enables.
+ * Runs which change the memory mappings fall back to a new fork. Kernel
+ * state, such as open files, is not restored.
+ *
+ * @param enabled non-zero to restore the child, 0 to fork each run
+ */
+extern void coincident_set_snapshot_restore(int enabled);
+
+/**
+ * Explore schedules from checkpoints
+ *
+ * The child is checkpointed (forked while stopped) at some scheduling
+ * decisions. Later runs continue from these with another thread selected,
+ * instead of running the common prefix again. Checkpoints are only taken
+ * while no thread is blocked and no semaphore is taken. They are disabled
+ * when a race detector is enabled, since the detectors would miss the
+ * accesses before the checkpoint.
+ *
+ * @param max_checkpoints the number of live checkpoints, the least recently
+ * used ones are evicted. 0 disables checkpoints
+ */
+extern void coincident_set_checkpoints(int max_checkpoints);
+
+/**
+ * Break on stores relative to the stack or frame pointer
+ *
+ * These are skipped by default, since they go to the stack of the running
+ * thread (spills and locals). Enable this if threads access each other's
+ * locals through pointers, or if the code is built without frame pointers.
+ *
+ * @param enabled non-zero to break on stack stores as well
+ */
+extern void coincident_set_stack_stores(int enabled);
+
+/**
+ * Disarm store sites which only write thread-private memory
+ *
+ * The address of each store is decoded when its breakpoint is hit. Loads are
+ * trapped and decoded as well, so that a word written by one thread and read
+ * by another counts as shared. A site which hasn't accessed a word that
+ * another thread also accesses, with at least one of them writing, in
+ * @a n_runs runs is disarmed for the remaining runs. This cuts the number
+ * of traps, but can hide races on data which is only shared in rare
+ * schedules.
+ *
+ * @param n_runs the number of runs before a site is pruned, 0 (the
+ * default) to disable pruning
+ */
+extern void coincident_set_store_pruning(int n_runs);
+
+/**
+ * Detect data races with happens-before analysis
+ *
+ * Accesses are ordered through vector clocks, which are passed between the
+ * threads by the semaphores and mutexes. Two accesses to the same byte by
+ * different threads, of which at least one is a write, and which are not
+ * ordered, are reported as an error with both sites. The race is found in
+ * the first run where both accesses happen, also if the schedule doesn't
+ * make it visible. Breakpoints are set on loads as well in this mode.
+ *
+ * @param enabled non-zero to enable the detector
+ */
+extern void coincident_set_happens_before(int enabled);
+
+/**
+ * Check that shared memory is consistently protected by a mutex
+ *
+ * Eraser-style lockset checking: each word which is written by more than
+ * one thread must have at least one mutex which is held at every access
+ * to it. A word where no common mutex remains is reported as an error with
+ * the backtraces of the last two accesses. This doesn't depend on the
+ * schedule, so a single run covers what otherwise needs many runs, but
+ * ordering through other means than mutexes gives false reports.
+ * Breakpoints are set on loads as well in this mode.
+ *
+ * @param enabled non-zero to enable the detector
+ */
+extern void coincident_set_lockset(int enabled);
+
+/**
+ * Detect atomicity violations
+ *
+ * For two consecutive accesses by a thread to the same word, with an
+ * access by another thread in between, the interleaving is reported as an
+ * error if no serial order gives the same result. This catches
+ * check-then-act and read-modify-write bugs, which aren't always data
+ * races. Breakpoints are set on loads as well in this mode.
+ *
+ * @param enabled non-zero to enable the detector
+ */
+extern void coincident_set_atomicity(int enabled);
+
+/**
+ * Preempt threads where the detectors ask for it
+ *
+ * With coincident_set_atomicity(), the current thread is switched out
+ * right after an access to a word which other threads also access, so
+ * that the remote access lands between the two local ones. One such
+ * preemption is done per run, each time at a site which wasn't tried in
+ * an earlier run.
+ *
+ * @param enabled non-zero to enable guided preemption
+ */
+extern void coincident_set_guided_preemption(int enabled);
+
 
 
 /**
@@ -51,6 +218,42 @@ extern void coincident_set_time_limit(int n_ms);
  */
 extern void coincident_set_bucket_selector(int *buckets, unsigned int n_buckets);
 
+/**
+ * Setup a race-directed thread selector
+ *
+ * The first @a collect_runs runs are scheduled randomly. They collect
+ * pairs of sites where two threads access the same word, and at least one
+ * of the accesses is a write. Each following run targets one pair in one
+ * order. A thread which reaches the first site is parked before the
+ * access, until another thread is about to access the same word from the
+ * partner site. Then either the parked thread or the arriving thread goes
+ * first. All pairs are covered in @a collect_runs plus two runs per pair.
+ * Loads are trapped as well with this selector.
+ *
+ * The runs are done one at a time: coincident_run() fails if workers,
+ * the pipeline, concurrent sessions or checkpoints are enabled.
+ *
+ * @param collect_runs the number of runs which collect pairs
+ */
+extern void coincident_set_race_fuzzer(int collect_runs);
+
+/**
+ * Setup a PCT (probabilistic concurrency testing) thread selector
+ *
+ * The threads get random priorities when a run starts, and the highest
+ * priority runnable thread always runs. At @a depth - 1 random points in
+ * the run, the running thread is lowered below all others. The points are
+ * chosen among the number of events of the previous run. A bug which needs
+ * @a depth ordering constraints is found with a probability of at least
+ * 1 / (n * k^(depth-1)) per run, with n threads and k events.
+ *
+ * Each run depends on the previous one, so coincident_run() fails if
+ * workers, the pipeline, concurrent sessions or checkpoints are enabled.
+ *
+ * @param depth the bug depth to target, at least 1
+ */
+extern void coincident_set_pct_selector(int depth);
+
 /**
  * Setup the debug mask.
  *
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace coincident
@@ -19,11 +20,89 @@ namespace coincident
 		class IThreadSelector
 		{
 		public:
+			virtual ~IThreadSelector()
+			{
+			}
+
 			virtual int selectThread(int curThread,
 					IThread **threads,
 					int nThreads,
 					uint64_t timeUs,
 					const PtraceEvent *) = 0;
+
+			/**
+			 * Select the next thread from a bitmap of the runnable threads,
+			 * which saves building the list of them on each event.
+			 *
+			 * @param curThread the current thread, an index in @a threads
+			 * @param threads all threads, including the blocked ones
+			 * @param nThreads the number of threads
+			 * @param runnable bit i is set if threads[i] is not blocked
+			 * @param nRunnable the number of bits set in @a runnable
+			 *
+			 * @return the index of the next thread in @a threads, or -1 to
+			 * use selectThread() with the list of runnable threads
+			 */
+			virtual int selectRunnable(int curThread,
+					IThread **threads,
+					int nThreads,
+					const unsigned long *runnable,
+					int nRunnable,
+					uint64_t timeUs,
+					const PtraceEvent *)
+			{
+				return -1;
+			}
+
+			/**
+			 * @return true if the selector wants to see the memory accesses
+			 * through onAccess(). Loads are trapped as well then.
+			 */
+			virtual bool wantsAccesses()
+			{
+				return false;
+			}
+
+			/**
+			 * A thread is about to access memory, called before the
+			 * instruction executes
+			 *
+			 * @param thread the accessing thread
+			 * @param site the address of the instruction
+			 * @param addr the accessed address
+			 * @param size the size of the access in bytes
+			 * @param isStore true for writes
+			 *
+			 * @return true to postpone the access: the thread is switched
+			 * out, and traps at the same site again when it next runs
+			 */
+			virtual bool onAccess(IThread *thread, void *site,
+					void *addr, size_t size, bool isStore)
+			{
+				return false;
+			}
+
+			/**
+			 * A run starts, either fresh or resumed from a checkpoint.
+			 * Called when the run becomes the current one, before the
+			 * initial thread is selected.
+			 *
+			 * @param threads the threads of the run
+			 * @param nThreads the number of threads
+			 */
+			virtual void onRunStart(IThread **threads, int nThreads)
+			{
+			}
+
+			/**
+			 * @return true if the selector keeps state from one run to the
+			 * next, so the runs must be done one at a time: no workers,
+			 * pipeline, concurrent sessions or checkpoints
+			 */
+			virtual bool needsSerialRuns()
+			{
+				return false;
+			}
 		};
 
 
@@ -50,6 +129,40 @@ namespace coincident
 
 		virtual void forceReschedule() = 0;
 
+		/**
+		 * Block or unblock a thread of the current session. The session
+		 * keeps track of the runnable threads, so use these instead of
+		 * IThread::block() and IThread::unBlock().
+		 *
+		 * @param thread the thread
+		 */
+		virtual void blockThread(IThread *thread) = 0;
+
+		virtual void unBlockThread(IThread *thread) = 0;
+
+		/**
+		 * Synchronization events from the semaphores, which order the
+		 * accesses for the race detectors
+		 *
+		 * @param thread the thread which acquires or releases
+		 * @param object the semaphore or lock
+		 */
+		virtual void onAcquire(IThread *thread, const void *object) = 0;
+
+		virtual void onRelease(IThread *thread, const void *object) = 0;
+
+		/**
+		 * Mutex operations, which give the locks held by each thread for
+		 * lockset checking. A thread which blocks in a lock holds the
+		 * mutex from here on, since it doesn't run until it gets it.
+		 *
+		 * @param thread the thread which locks or unlocks
+		 * @param lock the mutex
+		 */
+		virtual void onLock(IThread *thread, const void *lock) = 0;
+
+		virtual void onUnlock(IThread *thread, const void *lock) = 0;
+
 
 		/**
 		 * Report an error
@@ -72,5 +185,110 @@ namespace coincident
 		virtual void setRuns(int nRuns) = 0;
 
 		virtual void setTimeLimit(int ms) = 0;
+
+		/**
+		 * Run sessions in parallel in a number of worker processes
+		 *
+		 * @param nWorkers the number of workers, 1 to run serially
+		 */
+		virtual void setWorkers(int nWorkers) = 0;
+
+		/**
+		 * Drive several sessions at the same time from each process,
+		 * handling the events of the others while one child runs
+		 *
+		 * @param nSessions the number of sessions, 1 to run one at a time
+		 */
+		virtual void setConcurrentSessions(int nSessions) = 0;
+
+		/**
+		 * Fork and arm the child of the next session while the current
+		 * session runs
+		 *
+		 * @param enabled true to pipeline the sessions
+		 */
+		virtual void setPipeline(bool enabled) = 0;
+
+		/**
+		 * Fork the children for each run from a template where all
+		 * breakpoints are already armed.
+		 *
+		 * @param enabled true to use the fork server
+		 */
+		virtual void setForkServer(bool enabled) = 0;
+
+		/**
+		 * Keep the child between runs, and restore the pages it has written
+		 * from the fork server template. Enables the fork server.
+		 *
+		 * @param enabled true to restore instead of forking a new child
+		 */
+		virtual void setSnapshotRestore(bool enabled) = 0;
+
+		/**
+		 * Checkpoint the child at scheduling decisions, and explore the
+		 * other choices from there instead of from the start.
+		 *
+		 * @param maxCheckpoints the number of checkpoints to keep, the least
+		 * recently used are evicted. 0 disables checkpoints
+		 */
+		virtual void setCheckpoints(int maxCheckpoints) = 0;
+
+		/**
+		 * Set breakpoints on stores relative to the stack or frame pointer
+		 * as well. These are skipped by default, since each thread has its
+		 * own stack. Enable if threads share locals through pointers, or
+		 * if the code is built with -fomit-frame-pointer.
+		 *
+		 * @param enabled true to break on stack stores
+		 */
+		virtual void setStackStores(bool enabled) = 0;
+
+		/**
+		 * Disarm store sites which have only written thread-private
+		 * memory. The addresses of the stores, and of the loads, are
+		 * decoded at each breakpoint, and a site is disarmed after it has
+		 * been hit in @a nRuns runs without accessing a word which another
+		 * thread also accessed, with at least one of them writing. Load
+		 * sites are armed until they are disarmed the same way. The
+		 * profile is kept over all runs.
+		 *
+		 * @param nRuns the number of runs, 0 (the default) to never prune
+		 */
+		virtual void setStorePruning(int nRuns) = 0;
+
+		/**
+		 * Detect data races with vector clocks. Loads are trapped as
+		 * well, and unordered conflicting accesses are reported as errors.
+		 *
+		 * @param enabled true to enable the detector
+		 */
+		virtual void setHappensBefore(bool enabled) = 0;
+
+		/**
+		 * Check that shared memory is consistently protected by a mutex.
+		 * Loads are trapped as well, and accesses which hold no common
+		 * lock are reported as errors.
+		 *
+		 * @param enabled true to enable the detector
+		 */
+		virtual void setLockset(bool enabled) = 0;
+
+		/**
+		 * Detect atomicity violations: two accesses by one thread to the
+		 * same word, interleaved by another thread in a way which no
+		 * serial order explains.
+		 *
+		 * @param enabled true to enable the detector
+		 */
+		virtual void setAtomicity(bool enabled) = 0;
+
+		/**
+		 * Switch thread at the accesses where the detectors ask for it,
+		 * once per run and at a site which wasn't tried in earlier runs.
+		 *
+		 * @param enabled true to enable guided preemption
+		 */
+		virtual void setGuidedPreemption(bool enabled) = 0;
 	};
 }
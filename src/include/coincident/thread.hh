@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 namespace coincident
 {
 	class Session;
@@ -39,6 +41,18 @@ namespace coincident
 
 		virtual void *getPc() = 0;
 
+		/**
+		 * Decode the address accessed by the instruction at the PC, from
+		 * the saved registers
+		 *
+		 * @param size the size of the access in bytes, filled in
+		 *
+		 * @return the address, or NULL if the instruction doesn't access
+		 * memory or the address can't be decoded (e.g., with a segment
+		 * override)
+		 */
+		virtual void *getMemoryAddress(size_t *size) = 0;
+
 
 		/**
 		 * Do a backtrace for this thread. Simply because the libc backtrace()
@@ -60,6 +74,13 @@ namespace coincident
 				int (*fn)(void *), void *arg);
 
 		static void releaseThread(IThread *thread);
+
+		static IThread *copyThread(IThread *thread);
+
+		static void setStackSize(size_t size);
+
+		// Index in the thread factory table, so releases need no lookup
+		unsigned int m_factorySlot;
 	};
 
 
@@ -70,5 +91,30 @@ namespace coincident
 				int (*fn)(void *), void *arg);
 
 		static void releaseThread(IThread &thread);
+
+		/**
+		 * Copy the state of a thread, e.g., for a checkpoint. The copy
+		 * shares the stack with the original, and is not one of the
+		 * running threads until passed to restoreThread().
+		 */
+		static IThread *copyThread(IThread &thread);
+
+		static void releaseCopy(IThread *copy);
+
+		/**
+		 * Create a running thread from a copy
+		 */
+		static IThread &restoreThread(IThread &copy);
+
+		/**
+		 * Set the stack size of threads created from now on. Pooled stacks
+		 * of the old size are released.
+		 *
+		 * @param size the size in bytes, rounded up to whole pages
+		 */
+		static void setStackSize(size_t size);
+
+	private:
+		static IThread &addThread(IThread *thread);
 	};
 }
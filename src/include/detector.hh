@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace coincident
+{
+	class IThread;
+
+	/**
+	 * Analysis of the memory accesses and the synchronization in a run,
+	 * fed from the breakpoints and the semaphore handlers. Each session
+	 * has its own detectors.
+	 */
+	class IDetector
+	{
+	public:
+		/**
+		 * Vector clock based happens-before race detection
+		 */
+		static IDetector *createHappensBefore();
+
+		/**
+		 * Eraser-style lockset checking, independent of the schedule
+		 */
+		static IDetector *createLockset();
+
+		/**
+		 * AVIO-style detection of unserializable access triples
+		 */
+		static IDetector *createAtomicity();
+
+		virtual ~IDetector()
+		{
+		}
+
+		/**
+		 * Forget everything, for a new run
+		 */
+		virtual void reset() = 0;
+
+		/**
+		 * A thread accesses memory
+		 *
+		 * @param thread the accessing thread
+		 * @param site the address of the instruction
+		 * @param addr the accessed address
+		 * @param size the size of the access in bytes
+		 * @param isStore true for writes
+		 *
+		 * @return true if a problem was found, described by getReport()
+		 */
+		virtual bool onAccess(IThread *thread, void *site,
+				void *addr, size_t size, bool isStore) = 0;
+
+		/**
+		 * A thread has taken a lock or waited for a semaphore
+		 *
+		 * @param thread the thread
+		 * @param object the lock or semaphore
+		 */
+		virtual void onAcquire(IThread *thread, const void *object) = 0;
+
+		/**
+		 * A thread has released a lock or signalled a semaphore
+		 *
+		 * @param thread the thread
+		 * @param object the lock or semaphore
+		 */
+		virtual void onRelease(IThread *thread, const void *object) = 0;
+
+		/**
+		 * A thread has taken a mutex, or blocks until it gets it
+		 *
+		 * @param thread the thread
+		 * @param lock the mutex
+		 */
+		virtual void onLock(IThread *thread, const void *lock) = 0;
+
+		/**
+		 * A thread has released a mutex
+		 *
+		 * @param thread the thread
+		 * @param lock the mutex
+		 */
+		virtual void onUnlock(IThread *thread, const void *lock) = 0;
+
+		/**
+		 * @return true if switching thread right after the last access
+		 * could expose a problem, for guided preemption
+		 */
+		virtual bool wantsPreemption() = 0;
+
+		/**
+		 * @return a description of the last problem found
+		 */
+		virtual const char *getReport() = 0;
+	};
+}
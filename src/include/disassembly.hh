@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
 
 namespace coincident
@@ -10,17 +11,80 @@ namespace coincident
 		class IInstructionListener
 		{
 		public:
-			virtual void onMemoryReference(off_t offset, bool isLoad) = 0;
+			/**
+			 * Called for each instruction with a memory operand
+			 *
+			 * @param offset the offset of the instruction
+			 * @param isLoad true if the memory operand is the source
+			 * @param isStackLocal true if the operand is relative to the
+			 * stack or frame pointer, i.e., in the frame of the current thread
+			 */
+			virtual void onMemoryReference(off_t offset, bool isLoad, bool isStackLocal) = 0;
 
 			virtual void onCall(off_t offset) = 0;
 
 			virtual void onBranch(off_t offset) = 0;
 		};
 
+		class Operand
+		{
+		public:
+			enum OperandType
+			{
+				OP_NONE,
+				OP_REGISTER,
+				OP_IMMEDIATE,
+				OP_MEMORY,
+				OP_OTHER, // Segment registers, 16-bit addressing etc
+			};
+
+			enum OperandType type;
+			size_t size; // In bytes
+
+			// Registers are numbered as in the encoding: eax, ecx, edx, ebx, esp, ebp, esi, edi,
+			// and r8-r15 on x86_64
+			int reg;
+			bool highByte; // ah, ch, dh or bh
+
+			// Memory references, -1 for unused registers
+			int base;
+			int index;
+			unsigned int scale;
+			long displacement;
+			bool pcRelative; // Relative to the next instruction (RIP-relative)
+
+			unsigned long immediate;
+		};
+
+		class Instruction
+		{
+		public:
+			size_t size;
+			bool isControlTransfer; // Branches, calls, returns, interrupts
+			bool isPcRelative; // Has an operand relative to the PC
+			bool isMove; // A plain mov
+			bool isAddressOnly; // lea, nop etc, where the memory operand isn't accessed
+			bool hasSegmentPrefix;
+
+			// Destination first
+			Operand operands[2];
+		};
+
 		static IDisassembly &getInstance();
 
 
 		virtual bool execute(IInstructionListener *listener,
 				uint8_t *data, size_t size) = 0;
+
+		/**
+		 * Decode a single instruction
+		 *
+		 * @param out the decoded instruction
+		 * @param data the instruction bytes
+		 * @param size the number of bytes available at @a data
+		 *
+		 * @return true if a valid instruction was decoded
+		 */
+		virtual bool decode(Instruction &out, const uint8_t *data, size_t size) = 0;
 	};
 }
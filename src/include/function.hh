@@ -24,8 +24,25 @@ namespace coincident
 
 		virtual size_t getSize() = 0;
 
+		/**
+		 * @return the loads, except those relative to the stack or
+		 * frame pointer
+		 */
 		virtual ReferenceList_t &getMemoryLoads() = 0;
 
+		virtual ReferenceList_t &getStackMemoryLoads() = 0;
+
+		/**
+		 * @return the stores, except those relative to the stack or
+		 * frame pointer
+		 */
 		virtual ReferenceList_t &getMemoryStores() = 0;
+
+		/**
+		 * @return the stores relative to the stack or frame pointer. These
+		 * go to the stack of the running thread, and are typically spills
+		 * and locals
+		 */
+		virtual ReferenceList_t &getStackMemoryStores() = 0;
 	};
 }
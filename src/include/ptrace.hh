@@ -3,6 +3,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+// x86 has four debug registers for breakpoint addresses
+#define N_HW_BREAKPOINTS 4
+
+// Buffer size for the FP registers, large enough for the XSAVE area
+#define FP_REGISTERS_SIZE 4096
+
 namespace coincident
 {
 	enum ptrace_event_type
@@ -31,8 +37,28 @@ namespace coincident
 
 		virtual bool readMemory(uint8_t *dst, void *start, size_t bytes) = 0;
 
+		/**
+		 * Read memory from the traced process
+		 *
+		 * @param dst the buffer to read into
+		 * @param start the address in the traced process (any alignment)
+		 * @param bytes the number of bytes to read
+		 *
+		 * @return true if all bytes could be read
+		 */
 		virtual bool readProcessMemory(uint8_t *dst, void *start, size_t bytes) = 0;
 
+		/**
+		 * Write memory in the traced process
+		 *
+		 * @param dst the address in the traced process (any alignment)
+		 * @param src the data to write
+		 * @param bytes the number of bytes to write
+		 *
+		 * @return true if all bytes could be written
+		 */
+		virtual bool writeProcessMemory(void *dst, const uint8_t *src, size_t bytes) = 0;
+
 		/**
 		 * Set a breakpoint
 		 *
@@ -42,11 +68,68 @@ namespace coincident
 		 */
 		virtual int setBreakpoint(void *addr) = 0;
 
+		/**
+		 * Set a number of breakpoints at once. The sites are grouped by
+		 * page, so each modified page is written back with a single write.
+		 *
+		 * @param addrs the addresses to set breakpoints on
+		 * @param ids filled in with the ID of each breakpoint, or -1 on failure
+		 * @param n the number of addresses
+		 *
+		 * @return true if all breakpoints were set
+		 */
+		virtual bool setBreakpoints(void **addrs, int *ids, int n) = 0;
+
 		virtual bool clearBreakpoint(int id) = 0;
 
 
 		virtual void clearAllBreakpoints() = 0;
 
+		/**
+		 * Move a breakpoint from an int3 to a hardware debug register. The
+		 * breakpoint keeps its ID, and the original instruction is restored.
+		 *
+		 * @param id the breakpoint to move
+		 *
+		 * @return true if the breakpoint is now in a debug register, false
+		 * if all N_HW_BREAKPOINTS registers are used
+		 */
+		virtual bool setHardwareBreakpoint(int id) = 0;
+
+		/**
+		 * Move a breakpoint from a debug register back to an int3
+		 *
+		 * @param id the breakpoint to move
+		 *
+		 * @return true if the breakpoint was in a debug register
+		 */
+		virtual bool clearHardwareBreakpoint(int id) = 0;
+
+		/**
+		 * Check if the last stop was a hardware breakpoint. The PC then
+		 * points to the breakpoint instruction itself, not after it.
+		 */
+		virtual bool stoppedAtHardwareBreakpoint() = 0;
+
+		/**
+		 * Get an out-of-line copy of the instruction at a breakpoint. The
+		 * copy jumps back to the instruction after the original, so a
+		 * thread steps over the breakpoint by continuing at the copy.
+		 *
+		 * @param addr the address of the breakpoint
+		 *
+		 * @return the address of the copy in the traced process, or NULL
+		 * if the instruction cannot be executed out of line
+		 */
+		virtual void *getDisplacedCopy(void *addr) = 0;
+
+		/**
+		 * Map a new area for the out-of-line copies, which is not shared
+		 * with the process we were forked from. Called in workers, which
+		 * otherwise overwrite each others copies. Earlier copies are dropped.
+		 */
+		virtual void remapDisplacedArea() = 0;
+
 
 		/**
 		 * For a new process and attach to it with ptrace
@@ -55,15 +138,78 @@ namespace coincident
 		 */
 		virtual int forkAndAttach() = 0;
 
+		/**
+		 * Fork and attach to a fork server template. The template becomes
+		 * the current child, so that breakpoints can be set in it before
+		 * the first call to forkFromTemplate().
+		 *
+		 * @return 0 when in the template, -1 on error or the pid otherwise
+		 */
+		virtual int forkTemplate() = 0;
+
+		/**
+		 * Let the template fork a new child, and make it the current one.
+		 * The child inherits the breakpoints set in the template.
+		 *
+		 * @return the pid of the new child, or -1 on error
+		 */
+		virtual int forkFromTemplate() = 0;
+
+		virtual void killTemplate() = 0;
+
+		/**
+		 * Restore the current child to the state of the template instead
+		 * of killing it. Only the pages written since the child was forked
+		 * or last restored (the soft-dirty pages) are copied back, and the
+		 * next forkFromTemplate() returns the restored child.
+		 *
+		 * Kernel state such as open files is not restored.
+		 *
+		 * @return true if the child was restored, false if it should be
+		 * killed instead (e.g., if the run changed the memory mappings)
+		 */
+		virtual bool restoreChild() = 0;
+
+		/**
+		 * Checkpoint the current child by letting it fork a copy of itself,
+		 * which is kept stopped together with the breakpoint state.
+		 *
+		 * @return the pid of the checkpoint, or -1 on error
+		 */
+		virtual int checkpoint() = 0;
+
+		/**
+		 * Let a checkpoint fork a new child, and make it the current one.
+		 * The checkpoint itself is kept, so it can be resumed again.
+		 *
+		 * @param checkpoint the checkpoint pid
+		 *
+		 * @return the pid of the new child, or -1 on error
+		 */
+		virtual int forkFromCheckpoint(int checkpoint) = 0;
+
+		virtual void releaseCheckpoint(int checkpoint) = 0;
+
 
 		virtual void loadRegisters(void *regs) = 0;
 
 		virtual void saveRegisters(void *regs) = 0;
 
+		/**
+		 * Load or save the FP/SSE/AVX state of the current child, in the
+		 * XSAVE layout if the kernel supports it and FXSAVE otherwise.
+		 *
+		 * @param regs buffer of FP_REGISTERS_SIZE bytes
+		 */
 		virtual void loadFpRegisters(void *regs) = 0;
 
 		virtual void saveFpRegisters(void *regs) = 0;
 
+		/**
+		 * @return the pid of the current child, or -1 if there is none
+		 */
+		virtual int getCurrentChild() = 0;
+
 		/**
 		 * Step over to the next instruction.
 		 *
@@ -78,6 +224,34 @@ namespace coincident
 		 */
 		virtual const PtraceEvent continueExecution() = 0;
 
+		/**
+		 * Continue execution of the current child without waiting for it
+		 * to stop. Several children can be running at the same time.
+		 *
+		 * @return true if the child was resumed
+		 */
+		virtual bool resume() = 0;
+
+		/**
+		 * Wait for the next event from any of the resumed children. The
+		 * child the event is from becomes the current one.
+		 *
+		 * @param out the event the child stopped at
+		 *
+		 * @return the pid of the child, or -1 if no child is running
+		 */
+		virtual int waitEvent(PtraceEvent &out) = 0;
+
+		/**
+		 * Make another traced child the current one. Memory, register and
+		 * breakpoint operations all work on the current child.
+		 *
+		 * @param pid the child to select
+		 *
+		 * @return true if @a pid is a traced child
+		 */
+		virtual bool selectChild(int pid) = 0;
+
 		virtual void kill() = 0;
 	};
 }
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string.h>
+#include <map>
+
+#define SHADOW_PAGE_SIZE 4096
+
+namespace coincident
+{
+	/**
+	 * Shadow memory for the detectors: one T per word of the traced
+	 * process, in pages which are allocated on first access and cleared
+	 * to zero. T must be valid when all zero, and is never destructed.
+	 */
+	template <typename T>
+	class ShadowMemory
+	{
+	public:
+		ShadowMemory() : m_lastPage(0), m_lastShadow(NULL)
+		{
+		}
+
+		~ShadowMemory()
+		{
+			clear();
+		}
+
+		/**
+		 * @param word a word-aligned address
+		 *
+		 * @return the shadow entry of @a word
+		 */
+		T &lookup(unsigned long word)
+		{
+			unsigned long page = word / SHADOW_PAGE_SIZE;
+			unsigned int idx = (word % SHADOW_PAGE_SIZE) / sizeof(unsigned long);
+
+			// Accesses are mostly local, so try the last page first
+			if (m_lastShadow && page == m_lastPage)
+				return m_lastShadow[idx];
+
+			typename ShadowPageMap_t::iterator it = m_pages.find(page);
+			T *p;
+
+			if (it == m_pages.end()) {
+				p = new T[wordsPerPage];
+				memset((void *)p, 0, sizeof(T) * wordsPerPage);
+				m_pages[page] = p;
+			} else {
+				p = it->second;
+			}
+
+			m_lastPage = page;
+			m_lastShadow = p;
+
+			return p[idx];
+		}
+
+		void clear()
+		{
+			for (typename ShadowPageMap_t::iterator it = m_pages.begin();
+					it != m_pages.end();
+					it++)
+				delete[] it->second;
+
+			m_pages.clear();
+			m_lastPage = 0;
+			m_lastShadow = NULL;
+		}
+
+	private:
+		typedef std::map<unsigned long, T *> ShadowPageMap_t;
+
+		static const unsigned int wordsPerPage = SHADOW_PAGE_SIZE / sizeof(unsigned long);
+
+		ShadowPageMap_t m_pages;
+		unsigned long m_lastPage;
+		T *m_lastShadow;
+	};
+}
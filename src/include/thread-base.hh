@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <coincident/thread.hh>
+#include <ptrace.hh>
+#include <disassembly.hh>
+
+#include <sys/user.h>
+
+// The registers in user_regs_struct which the shared code uses
+#if defined(__x86_64__)
+# define REGS_PC rip
+# define REGS_SP rsp
+# define REGS_FP rbp
+#else
+# define REGS_PC eip
+# define REGS_SP esp
+# define REGS_FP ebp
+#endif
+
+namespace coincident
+{
+	/**
+	 * The architecture-independent part of the thread backends: the stack
+	 * pool, register caching, lazy FP switching, breakpoint stepping and
+	 * backtraces. The backends add argument and register access, and set up
+	 * the stack and registers of new threads.
+	 */
+	class ThreadBase : public IThread
+	{
+	public:
+		ThreadBase();
+
+		// For checkpoints, the copy doesn't own the stack
+		ThreadBase(const ThreadBase &other);
+
+		virtual ~ThreadBase();
+
+		/**
+		 * Create a copy of the backend thread, for checkpoints
+		 */
+		virtual ThreadBase *clone() = 0;
+
+		void saveRegisters();
+
+		void saveFpRegisters();
+
+		void loadRegisters();
+
+		/**
+		 * @return true if this is the thread whose FP state is in the
+		 * current child
+		 */
+		bool isLive();
+
+		void stepOverBreakpoint();
+
+		void setPc(void *addr);
+
+		void *getPc();
+
+		void *getMemoryAddress(size_t *size);
+
+		int backtrace(unsigned long *buf, int maxValues);
+
+		void block();
+
+		void unBlock();
+
+		bool isBlocked();
+
+	protected:
+		/**
+		 * @param reg the register number in the instruction encoding
+		 *
+		 * @return the saved value of the register
+		 */
+		virtual unsigned long getRegister(int reg) = 0;
+
+		unsigned long getEffectiveAddress(const IDisassembly::Operand &op, size_t insnSize);
+
+		bool emulateStore();
+
+		uint8_t *m_stack;
+		uint8_t *m_stackStart;
+		size_t m_stackSize;
+		// The initial stack frame, written at m_stack when the thread first runs
+		unsigned long m_frame[2];
+		unsigned int m_frameWords;
+		bool m_frameWritten;
+		struct user_regs_struct m_regs;
+		uint8_t m_fpregs[FP_REGISTERS_SIZE];
+		// m_regs differs from the registers in the child
+		bool m_regsDirty;
+		// m_fpregs has been saved, otherwise the thread takes over the current state
+		bool m_fpValid;
+
+		bool m_blocked;
+		bool m_ownsStack;
+	};
+}
@@ -51,6 +51,19 @@ static inline void coin_debug(enum debug_mask dbg, const char *fmt, ...)
 #define panic_if(cond, x...) \
 		do { if ((cond)) panic(x); } while(0)
 
+// The word-aligned address @a addr is in
+static inline unsigned long coin_word(unsigned long addr)
+{
+	return addr & ~(sizeof(unsigned long) - 1);
+}
+
+// Loop over the words an access of @a size bytes at @a addr touches
+#define for_each_word(word, addr, size) \
+	for (unsigned long word = coin_word((unsigned long)(addr)), \
+			word##_last = coin_word((unsigned long)(addr) + (size) - 1); \
+			word <= word##_last; \
+			word += sizeof(unsigned long))
+
 static inline char *xstrdup(const char *s)
 {
 	char *out = strdup(s);
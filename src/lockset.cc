@@ -0,0 +1,325 @@
+#include <detector.hh>
+#include <shadow-memory.hh>
+#include <utils.hh>
+#include <coincident/thread.hh>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <vector>
+#include <string>
+
+using namespace coincident;
+
+#define LOCKSET_BACKTRACE_DEPTH 6
+
+/*
+ * Eraser-style lockset detector. Each word of memory goes through the
+ * virgin -> exclusive -> shared -> shared-modified states, and once it is
+ * shared, the candidate lockset is refined with the locks held at each
+ * access. An empty lockset for a shared-modified word is reported once.
+ *
+ * The shadow memory is a 12-byte entry per word, in pages which are
+ * allocated on first access. Locksets and access backtraces are interned
+ * in tables, and the shadow entries only hold indexes to them.
+ */
+class Lockset : public IDetector
+{
+public:
+	Lockset()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		m_shadow.clear();
+
+		m_threadIds.clear();
+		m_held.clear();
+		m_locksets.clear();
+		m_locksetIndex.clear();
+		m_intersections.clear();
+		m_accesses.clear();
+		m_accessIndex.clear();
+		m_report.clear();
+
+		// Index 0 is the empty lockset
+		internLockset(LockList_t());
+	}
+
+	bool onAccess(IThread *thread, void *site,
+			void *addr, size_t size, bool isStore)
+	{
+		int tid = getThreadId(thread);
+		uint32_t access = 0;
+
+		for_each_word(word, addr, size) {
+			ShadowWord &shadow = m_shadow.lookup(word);
+
+			// Backtraces are only taken once per access
+			if (access == 0)
+				access = internAccess(thread, tid, site, isStore);
+
+			if (shadow.access != 0 && m_accesses[shadow.access - 1].tid != tid)
+				shadow.remoteAccess = shadow.access;
+			shadow.access = access;
+
+			if (updateState(shadow, tid, isStore) && shadow.remoteAccess != 0)
+				return reportViolation(word, shadow.remoteAccess, access);
+		}
+
+		return false;
+	}
+
+	// Semaphores don't protect data like locks do, only onLock/onUnlock count
+	void onAcquire(IThread *thread, const void *object)
+	{
+	}
+
+	void onRelease(IThread *thread, const void *object)
+	{
+	}
+
+	void onLock(IThread *thread, const void *lock)
+	{
+		int tid = getThreadId(thread);
+		LockList_t locks = m_locksets[m_held[tid]];
+
+		if (std::find(locks.begin(), locks.end(), lock) != locks.end())
+			return;
+
+		locks.push_back(lock);
+		std::sort(locks.begin(), locks.end());
+		m_held[tid] = internLockset(locks);
+	}
+
+	void onUnlock(IThread *thread, const void *lock)
+	{
+		int tid = getThreadId(thread);
+		LockList_t locks = m_locksets[m_held[tid]];
+		LockList_t::iterator it = std::find(locks.begin(), locks.end(), lock);
+
+		if (it == locks.end())
+			return;
+
+		locks.erase(it);
+		m_held[tid] = internLockset(locks);
+	}
+
+	bool wantsPreemption()
+	{
+		return false;
+	}
+
+	const char *getReport()
+	{
+		return m_report.c_str();
+	}
+
+private:
+	enum
+	{
+		ST_VIRGIN = 0,
+		ST_EXCLUSIVE = 1,
+		ST_SHARED = 2,
+		ST_SHARED_MODIFIED = 3
+	};
+
+	// Thread ID when exclusive, otherwise the candidate lockset
+	class ShadowWord
+	{
+	public:
+		uint32_t state : 2;
+		uint32_t value : 30;
+		uint32_t access; // Index + 1 in m_accesses, 0 for none
+		uint32_t remoteAccess; // The last one by another thread
+	};
+
+	class Access
+	{
+	public:
+		int tid;
+		bool isStore;
+		void *site;
+		int nFrames;
+		unsigned long frames[LOCKSET_BACKTRACE_DEPTH];
+	};
+
+	typedef std::vector<const void *> LockList_t;
+	typedef std::map<IThread *, int> ThreadIdMap_t;
+	typedef std::map<LockList_t, uint32_t> LocksetIndexMap_t;
+	typedef std::map<std::pair<uint32_t, uint32_t>, uint32_t> IntersectionMap_t;
+	typedef std::map<std::vector<unsigned long>, uint32_t> AccessIndexMap_t;
+
+	int getThreadId(IThread *thread)
+	{
+		ThreadIdMap_t::iterator it = m_threadIds.find(thread);
+
+		if (it != m_threadIds.end())
+			return it->second;
+
+		int tid = m_held.size();
+
+		m_threadIds[thread] = tid;
+		m_held.push_back(0);
+
+		return tid;
+	}
+
+	// Run the state machine, @return true if the lockset became empty
+	bool updateState(ShadowWord &shadow, int tid, bool isStore)
+	{
+		uint32_t held = m_held[tid];
+
+		switch (shadow.state) {
+		case ST_VIRGIN:
+			shadow.state = ST_EXCLUSIVE;
+			shadow.value = tid;
+			return false;
+
+		case ST_EXCLUSIVE:
+			if ((int)shadow.value == tid)
+				return false;
+
+			// Initialized by another thread, starts with the locks held now
+			shadow.state = isStore ? ST_SHARED_MODIFIED : ST_SHARED;
+			shadow.value = held;
+
+			return isStore && held == 0;
+
+		case ST_SHARED:
+			shadow.value = intersect(shadow.value, held);
+			if (!isStore)
+				return false;
+
+			shadow.state = ST_SHARED_MODIFIED;
+
+			return shadow.value == 0;
+
+		default:
+			// Only report the first time the lockset becomes empty
+			if (shadow.value == 0)
+				return false;
+
+			shadow.value = intersect(shadow.value, held);
+
+			return shadow.value == 0;
+		}
+	}
+
+	uint32_t internLockset(const LockList_t &locks)
+	{
+		LocksetIndexMap_t::iterator it = m_locksetIndex.find(locks);
+
+		if (it != m_locksetIndex.end())
+			return it->second;
+
+		uint32_t out = m_locksets.size();
+
+		m_locksets.push_back(locks);
+		m_locksetIndex[locks] = out;
+
+		return out;
+	}
+
+	uint32_t intersect(uint32_t a, uint32_t b)
+	{
+		if (a == b || a == 0)
+			return a;
+		if (b == 0)
+			return 0;
+
+		std::pair<uint32_t, uint32_t> key(std::min(a, b), std::max(a, b));
+		IntersectionMap_t::iterator it = m_intersections.find(key);
+
+		if (it != m_intersections.end())
+			return it->second;
+
+		const LockList_t &first = m_locksets[a];
+		const LockList_t &second = m_locksets[b];
+		LockList_t locks;
+
+		std::set_intersection(first.begin(), first.end(),
+				second.begin(), second.end(),
+				std::back_inserter(locks));
+
+		uint32_t out = internLockset(locks);
+
+		m_intersections[key] = out;
+
+		return out;
+	}
+
+	uint32_t internAccess(IThread *thread, int tid, void *site, bool isStore)
+	{
+		Access cur;
+
+		cur.tid = tid;
+		cur.isStore = isStore;
+		cur.site = site;
+		cur.nFrames = thread->backtrace(cur.frames, LOCKSET_BACKTRACE_DEPTH);
+
+		std::vector<unsigned long> key(cur.frames, cur.frames + cur.nFrames);
+
+		key.push_back((unsigned long)site);
+		key.push_back((tid << 1) | isStore);
+
+		AccessIndexMap_t::iterator it = m_accessIndex.find(key);
+
+		if (it != m_accessIndex.end())
+			return it->second;
+
+		m_accesses.push_back(cur);
+		m_accessIndex[key] = m_accesses.size();
+
+		return m_accesses.size();
+	}
+
+	std::string accessToString(uint32_t access)
+	{
+		const Access &cur = m_accesses[access - 1];
+		char buf[64 + 20 * LOCKSET_BACKTRACE_DEPTH];
+		char *p = buf;
+
+		p += sprintf(p, "%s at %p (thread %d, backtrace ",
+				cur.isStore ? "write" : "read", cur.site, cur.tid);
+		for (int i = 0; i < cur.nFrames; i++)
+			p += sprintf(p, "%s0x%08lx", i == 0 ? "" : " -> ", cur.frames[i]);
+		sprintf(p, ")");
+
+		return std::string(buf);
+	}
+
+	bool reportViolation(unsigned long addr, uint32_t first, uint32_t second)
+	{
+		char buf[64];
+
+		snprintf(buf, sizeof(buf), "Lockset violation on 0x%08lx: ", addr);
+		m_report = std::string(buf) + accessToString(first) + " and " +
+				accessToString(second) + " hold no common lock";
+
+		return true;
+	}
+
+	ThreadIdMap_t m_threadIds;
+	std::vector<uint32_t> m_held;
+
+	std::vector<LockList_t> m_locksets;
+	LocksetIndexMap_t m_locksetIndex;
+	IntersectionMap_t m_intersections;
+
+	std::vector<Access> m_accesses;
+	AccessIndexMap_t m_accessIndex;
+
+	ShadowMemory<ShadowWord> m_shadow;
+
+	std::string m_report;
+};
+
+IDetector *IDetector::createLockset()
+{
+	return new Lockset();
+}
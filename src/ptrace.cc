@@ -1,23 +1,122 @@
 #include <ptrace.hh>
+#include <breakpoint-table.hh>
+#include <disassembly.hh>
 #include <utils.hh>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/ptrace.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
 #include <sched.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
 #include <map>
-#include <list>
+#include <set>
+#include <algorithm>
 
 using namespace coincident;
 
+// Out-of-line copies of breakpointed instructions, each followed by a jmp back
+#define DISPLACED_AREA_SIZE (4 * 1024 * 1024)
+#define DISPLACED_SLOT_SIZE 32
+#define MAX_INSN_SIZE 15
+// The system call stub and its data are in the last two slots
+#define SYSCALL_AREA_SIZE (2 * DISPLACED_SLOT_SIZE)
+
+#ifndef NT_X86_XSTATE
+#define NT_X86_XSTATE 0x202
+#endif
+
+/*
+ * Register names in struct user_regs_struct, and the requests for the
+ * FXSAVE layout which is the fallback for the FP state.
+ */
+#if defined(__x86_64__)
+# define REG_PC rip
+# define REG_SYSCALL rax
+# define REG_ORIG_SYSCALL orig_rax
+# define PTRACE_GETFXSAVE PTRACE_GETFPREGS
+# define PTRACE_SETFXSAVE PTRACE_SETFPREGS
+#else
+# define REG_PC eip
+# define REG_SYSCALL eax
+# define REG_ORIG_SYSCALL orig_eax
+# define PTRACE_GETFXSAVE PTRACE_GETFPXREGS
+# define PTRACE_SETFXSAVE PTRACE_SETFPXREGS
+#endif
+
+// In /proc/<pid>/pagemap entries
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+#define PAGEMAP_BATCH 512
+
 class Ptrace : public IPtrace
 {
+	// Address and the byte to write there
+	typedef std::pair<unsigned long, uint8_t> Patch_t;
+	typedef std::vector<Patch_t> PatchList_t;
+
+	// The kernel struct sigaction, for rt_sigaction
+	struct KernelSigaction
+	{
+		unsigned long handler;
+		unsigned long flags;
+		unsigned long restorer;
+		uint32_t mask[2];
+	};
+
+	// State of a traced child which is not the current one
+	class ChildState
+	{
+	public:
+		ChildState() : memFd(-1), dr7(0), hardwareStop(false)
+		{
+			for (int dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+				hardwareIds[dr] = -1;
+				hardwareAddrs[dr] = 0;
+			}
+		}
+
+		int memFd;
+		BreakpointTable breakpoints;
+		int hardwareIds[N_HW_BREAKPOINTS];
+		unsigned long hardwareAddrs[N_HW_BREAKPOINTS];
+		unsigned long dr7;
+		bool hardwareStop;
+	};
+
 public:
 	Ptrace()
 	{
-		m_breakpointId = 0;
+		m_child = -1;
+		m_template = -1;
+		m_templateArmed = false;
+		m_templateMemFd = -1;
+		m_childRestored = false;
+		m_memFd = -1;
+		m_useXstate = true;
+		m_xstateSize = FP_REGISTERS_SIZE;
+		m_pageSize = sysconf(_SC_PAGESIZE);
+
+		resetHardwareBreakpoints();
+
+		mapDisplacedArea();
+	}
+
+	void remapDisplacedArea()
+	{
+		if (m_displacedArea)
+			munmap(m_displacedArea, DISPLACED_AREA_SIZE);
+		m_displaced.clear();
+
+		mapDisplacedArea();
 	}
 
 	bool readMemory(uint8_t *dst, void *start, size_t bytes)
@@ -29,28 +128,267 @@ public:
 
 	bool readProcessMemory(uint8_t *dst, void *start, size_t bytes)
 	{
-		panic_if (bytes != sizeof(unsigned long),
-				"Can only read a word at a time now");
+		struct iovec local, remote;
+		ssize_t res;
 
-		panic_if ((unsigned long)start & (sizeof(unsigned long) - 1),
-				"Address must be aligned");
+		if (bytes == 0)
+			return true;
 
-		unsigned long data = ptrace(PTRACE_PEEKTEXT, m_child, start, 0);
-		memcpy(dst, &data, bytes);
+		local.iov_base = dst;
+		local.iov_len = bytes;
+		remote.iov_base = start;
+		remote.iov_len = bytes;
 
-		return true;
+		res = process_vm_readv(m_child, &local, 1, &remote, 1, 0);
+		if (res == (ssize_t)bytes)
+			return true;
+
+		// Not supported by the kernel, or a partial read - use /proc/<pid>/mem
+		if (m_memFd < 0)
+			return false;
+
+		res = pread64(m_memFd, dst, bytes, (off64_t)(unsigned long)start);
+
+		return res == (ssize_t)bytes;
+	}
+
+	bool writeProcessMemory(void *dst, const uint8_t *src, size_t bytes)
+	{
+		struct iovec local, remote;
+		ssize_t res;
+
+		if (bytes == 0)
+			return true;
+
+		local.iov_base = (void *)src;
+		local.iov_len = bytes;
+		remote.iov_base = dst;
+		remote.iov_len = bytes;
+
+		// Fails on read-only mappings (e.g., text), which /proc/<pid>/mem handles
+		res = process_vm_writev(m_child, &local, 1, &remote, 1, 0);
+		if (res == (ssize_t)bytes)
+			return true;
+
+		if (m_memFd < 0)
+			return false;
+
+		res = pwrite64(m_memFd, src, bytes, (off64_t)(unsigned long)dst);
+
+		return res == (ssize_t)bytes;
 	}
 
 
 	int forkAndAttach()
+	{
+		return forkChild(false);
+	}
+
+	int forkTemplate()
+	{
+		int pid;
+
+		if (!m_syscallStub)
+			return -1;
+
+		killTemplate();
+
+		pid = forkChild(true);
+		if (pid > 0) {
+			char path[64];
+
+			m_template = pid;
+			m_templateArmed = false;
+
+			snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+			m_templateMemFd = open(path, O_RDONLY);
+		}
+
+		return pid;
+	}
+
+	int forkFromTemplate()
+	{
+		pid_t pid;
+
+		if (m_template < 0)
+			return -1;
+
+		// Restored at the end of the last run, so just reuse it
+		if (m_childRestored) {
+			m_childRestored = false;
+
+			return m_child;
+		}
+
+		// Breakpoints set up to now are in the template
+		if (!m_templateArmed) {
+			m_templateBreakpoints = m_breakpoints;
+			m_templateArmed = true;
+		}
+
+		parkChild();
+
+		pid = injectFork(m_template);
+		if (pid < 0)
+			return -1;
+
+		coin_debug(INFO_MSG, "INFO: Forked child %d from template %d\n",
+				pid, m_template);
+
+		m_child = pid;
+		m_breakpoints = m_templateBreakpoints;
+		resetHardwareBreakpoints();
+		openMemFile();
+
+		// Pages are inherited as soft-dirty, start tracking from here
+		clearSoftDirty(m_child);
+
+		return pid;
+	}
+
+	int checkpoint()
+	{
+		pid_t pid;
+		long res;
+
+		pid = injectFork(m_child);
+		if (pid < 0)
+			return -1;
+
+		// Children forked from the checkpoint are reaped automatically
+		injectSyscall(pid, SYS_rt_sigaction, SIGCHLD, (long)m_ignoreAction, 0,
+				sizeof(m_ignoreAction->mask), &res, NULL);
+
+		// Debug registers are not inherited, so put back the int3s
+		BreakpointTable &breakpoints = m_checkpoints[pid];
+
+		breakpoints = m_breakpoints;
+		for (int dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+			int id = m_hardwareIds[dr];
+
+			if (id < 0)
+				continue;
+
+			writeByte(pid, breakpoints.getAddress(id), 0xcc);
+			breakpoints.setHardware(id, false);
+		}
+
+		coin_debug(INFO_MSG, "INFO: Checkpoint %d of child %d\n",
+				pid, m_child);
+
+		return pid;
+	}
+
+	int forkFromCheckpoint(int checkpoint)
+	{
+		std::map<int, BreakpointTable>::iterator it = m_checkpoints.find(checkpoint);
+		pid_t pid;
+
+		if (it == m_checkpoints.end())
+			return -1;
+
+		// The last child might have been kept for restoring
+		if (m_childRestored) {
+			m_childRestored = false;
+			kill();
+		}
+
+		parkChild();
+
+		pid = injectFork(checkpoint);
+		if (pid < 0)
+			return -1;
+
+		m_child = pid;
+		m_breakpoints = it->second;
+		resetHardwareBreakpoints();
+		openMemFile();
+
+		return pid;
+	}
+
+	void releaseCheckpoint(int checkpoint)
+	{
+		int status;
+
+		if (m_checkpoints.erase(checkpoint) == 0)
+			return;
+
+		ptrace(PTRACE_KILL, checkpoint, 0, 0);
+		waitChild(checkpoint, &status);
+	}
+
+	bool restoreChild()
+	{
+		std::string maps;
+
+		if (m_template < 0 || m_child == m_template ||
+				m_memFd < 0 || m_templateMemFd < 0)
+			return false;
+
+		if (m_templateMaps.empty() &&
+				!readFile(m_template, "maps", m_templateMaps))
+			return false;
+
+		// New or removed mappings can't be restored by copying pages
+		if (!readFile(m_child, "maps", maps) || maps != m_templateMaps)
+			return false;
+
+		if (!restoreDirtyPages(maps) || !clearSoftDirty(m_child))
+			return false;
+
+		if (m_dr7 != 0)
+			pokeDebugRegister(7, 0);
+		resetHardwareBreakpoints();
+		m_breakpoints = m_templateBreakpoints;
+
+		m_childRestored = true;
+
+		return true;
+	}
+
+	void killTemplate()
+	{
+		int status;
+
+		if (m_template < 0)
+			return;
+
+		// The child is not killed at the end of runs when it's restored
+		if (m_childRestored) {
+			m_childRestored = false;
+			kill();
+		}
+
+		ptrace(PTRACE_KILL, m_template, 0, 0);
+		waitChild(m_template, &status);
+
+		if (m_child == m_template) {
+			m_child = -1;
+			closeMemFile();
+		}
+
+		if (m_templateMemFd >= 0)
+			close(m_templateMemFd);
+
+		m_template = -1;
+		m_templateMemFd = -1;
+		m_templateArmed = false;
+		m_templateBreakpoints.clear();
+		m_templateMaps.clear();
+	}
+
+	int forkChild(bool isTemplate)
 	{
 		pid_t child, who;
 		int status;
 		int myCpu = coin_get_current_cpu();
 
-		m_breakpointToAddrMap.clear();
-		m_addrToBreakpointMap.clear();
-		m_instructionMap.clear();
+		parkChild();
+		m_breakpoints.clear();
+		// Debug registers are not inherited by the child
+		resetHardwareBreakpoints();
 
 		child = fork();
 		if (child < 0) {
@@ -63,6 +401,10 @@ public:
 
 			coin_set_cpu(getpid(), myCpu);
 
+			// Killed children of the template are reaped automatically
+			if (isTemplate)
+				signal(SIGCHLD, SIG_IGN);
+
 			/* We're in the child, set me as traced */
 			res = ptrace(PTRACE_TRACEME, 0, 0, 0);
 			if (res < 0) {
@@ -89,27 +431,25 @@ public:
 		ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK);
 
 		m_child = child;
+		openMemFile();
 
 		return child;
 	}
 
 	int setBreakpoint(void *addr)
 	{
+		const BreakpointTable::Slot *slot = m_breakpoints.lookup(addr);
 		uint8_t data;
 		int id;
 
 		// There already?
-		if (m_addrToBreakpointMap.find(addr) != m_addrToBreakpointMap.end())
-			return m_addrToBreakpointMap[addr];
+		if (slot)
+			return slot->id;
 
 		if (readMemory(&data, addr, 1) == false)
 			return -1;
 
-		id = m_breakpointId++;
-
-		m_breakpointToAddrMap[id] = addr;
-		m_addrToBreakpointMap[addr] = id;
-		m_instructionMap[addr] = data;
+		id = m_breakpoints.insert(addr, data);
 
 		// Set the breakpoint
 		writeByte(m_child, addr, 0xcc);
@@ -117,39 +457,161 @@ public:
 		return id;
 	}
 
+	bool setBreakpoints(void **addrs, int *ids, int n)
+	{
+		PatchList_t patches;
+		bool out = true;
+
+		for (int i = 0; i < n; i++) {
+			const BreakpointTable::Slot *slot = m_breakpoints.lookup(addrs[i]);
+			void *addr = addrs[i];
+			uint8_t data;
+
+			if (slot) {
+				ids[i] = slot->id;
+				continue;
+			}
+
+			if (readMemory(&data, addr, 1) == false) {
+				ids[i] = -1;
+				out = false;
+				continue;
+			}
+
+			ids[i] = m_breakpoints.insert(addr, data);
+			patches.push_back(Patch_t((unsigned long)addr, 0xcc));
+		}
+
+		writePatches(patches);
+
+		return out;
+	}
+
 	void clearAllBreakpoints()
 	{
-		for (breakpointToAddrMap_t::iterator it = m_breakpointToAddrMap.begin();
-				it != m_breakpointToAddrMap.end(); it++)
-			clearBreakpoint(it->first);
+		PatchList_t patches;
+
+		patches.reserve(m_breakpoints.size());
+		for (unsigned int id = 0; id < m_breakpoints.getIdCount(); id++) {
+			void *addr = m_breakpoints.getAddress(id);
+
+			// Already cleared?
+			if (!addr)
+				continue;
+
+			const BreakpointTable::Slot *slot = m_breakpoints.lookup(addr);
+
+			// No int3 to restore
+			if (slot->hardware)
+				continue;
+
+			patches.push_back(Patch_t((unsigned long)addr, slot->instruction));
+		}
+
+		writePatches(patches);
+
+		if (m_dr7 != 0)
+			pokeDebugRegister(7, 0);
+		resetHardwareBreakpoints();
 
-		m_addrToBreakpointMap.clear();
-		m_addrToBreakpointMap.clear();
-		m_instructionMap.clear();
+		m_breakpoints.clear();
 	}
 
 	bool clearBreakpoint(int id)
 	{
-		if (m_breakpointToAddrMap.find(id) == m_breakpointToAddrMap.end())
+		void *addr = m_breakpoints.getAddress(id);
+
+		if (!addr)
 			return false;
 
-		void *addr = m_breakpointToAddrMap[id];
+		const BreakpointTable::Slot *slot = m_breakpoints.lookup(addr);
 
-		panic_if(m_addrToBreakpointMap.find(addr) == m_addrToBreakpointMap.end(),
+		panic_if(!slot,
 				"Breakpoint id, but no addr-to-id map!");
 
-		panic_if(m_instructionMap.find(addr) == m_instructionMap.end(),
-				"Breakpoint found, but no instruction data at that point!");
+		// Clear the actual breakpoint instruction
+		if (slot->hardware)
+			releaseDebugRegister(id);
+		else
+			writeByte(m_child, addr, slot->instruction);
 
-		m_breakpointToAddrMap.erase(id);
-		m_addrToBreakpointMap.erase(addr);
+		m_breakpoints.erase(id);
 
-		// Clear the actual breakpoint instruction
-		writeByte(m_child, addr, m_instructionMap[addr]);
+		return true;
+	}
+
+	bool setHardwareBreakpoint(int id)
+	{
+		void *addr = m_breakpoints.getAddress(id);
+		int dr;
+
+		if (!addr)
+			return false;
+
+		const BreakpointTable::Slot *slot = m_breakpoints.lookup(addr);
+
+		if (slot->hardware)
+			return true;
+
+		for (dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+			if (m_hardwareIds[dr] < 0)
+				break;
+		}
+		if (dr == N_HW_BREAKPOINTS)
+			return false;
+
+		// Execution breakpoint: R/W and LEN bits are 0, set the local enable
+		unsigned long dr7 = m_dr7 | (1UL << (2 * dr));
+
+		if (!pokeDebugRegister(dr, (unsigned long)addr) ||
+				!pokeDebugRegister(7, dr7))
+			return false;
+
+		m_dr7 = dr7;
+		m_hardwareIds[dr] = id;
+		m_hardwareAddrs[dr] = (unsigned long)addr;
+		m_breakpoints.setHardware(id, true);
+
+		// The int3 is no longer needed
+		writeByte(m_child, addr, slot->instruction);
 
 		return true;
 	}
 
+	bool clearHardwareBreakpoint(int id)
+	{
+		void *addr = m_breakpoints.getAddress(id);
+
+		if (!addr || !m_breakpoints.lookup(addr)->hardware)
+			return false;
+
+		releaseDebugRegister(id);
+
+		m_breakpoints.setHardware(id, false);
+		writeByte(m_child, addr, 0xcc);
+
+		return true;
+	}
+
+	bool stoppedAtHardwareBreakpoint()
+	{
+		return m_hardwareStop;
+	}
+
+	void *getDisplacedCopy(void *addr)
+	{
+		const BreakpointTable::Slot *slot = m_displaced.lookup(addr);
+
+		if (!slot)
+			slot = createDisplacedCopy(addr);
+
+		// Not possible to relocate
+		if (!slot || !slot->instruction)
+			return NULL;
+
+		return m_displacedArea + slot->id * DISPLACED_SLOT_SIZE;
+	}
+
 	void saveRegisters(void *regs)
 	{
 		ptrace(PTRACE_GETREGS, m_child, 0, regs);
@@ -162,12 +624,41 @@ public:
 
 	void saveFpRegisters(void *regs)
 	{
-		ptrace(PTRACE_GETFPXREGS, m_child, 0, regs);
+		// The whole XSAVE area has the AVX state as well
+		if (m_useXstate) {
+			struct iovec iov;
+
+			iov.iov_base = regs;
+			iov.iov_len = FP_REGISTERS_SIZE;
+			if (ptrace(PTRACE_GETREGSET, m_child, NT_X86_XSTATE, &iov) == 0) {
+				m_xstateSize = iov.iov_len;
+				return;
+			}
+			m_useXstate = false;
+		}
+
+		ptrace(PTRACE_GETFXSAVE, m_child, 0, regs);
 	}
 
 	void loadFpRegisters(void *regs)
 	{
-		ptrace(PTRACE_SETFPXREGS, m_child, 0, regs);
+		// The FXSAVE layout is the first part of the XSAVE one
+		if (m_useXstate) {
+			struct iovec iov;
+
+			iov.iov_base = regs;
+			iov.iov_len = m_xstateSize;
+			if (ptrace(PTRACE_SETREGSET, m_child, NT_X86_XSTATE, &iov) == 0)
+				return;
+			m_useXstate = false;
+		}
+
+		ptrace(PTRACE_SETFXSAVE, m_child, 0, regs);
+	}
+
+	int getCurrentChild()
+	{
+		return m_child;
 	}
 
 	void singleStep()
@@ -175,21 +666,34 @@ public:
 		struct user_regs_struct regs;
 		void *pc;
 
+		/*
+		 * Nothing to do for hardware breakpoints: the kernel has set the
+		 * resume flag, so the instruction executes when the thread continues.
+		 */
+		if (m_hardwareStop)
+			return;
+
 		ptrace(PTRACE_GETREGS, m_child, 0, &regs);
 		pc = getPcFromRegs(&regs);
 
-		panic_if(m_instructionMap.find(pc) == m_instructionMap.end(),
+		const BreakpointTable::Slot *slot = m_breakpoints.lookup(pc);
+
+		panic_if(!slot,
 				"Single-step over no breakpoint at %p", pc);
 
-		writeByte(m_child, pc, m_instructionMap[pc]);
+		writeByte(m_child, pc, slot->instruction);
 
 		// Step back one instruction
-		regs.eip--;
+		regs.REG_PC--;
 		ptrace(PTRACE_SETREGS, m_child, 0, &regs);
 
 		long res = ptrace(PTRACE_SINGLESTEP, m_child, 0, NULL);
 		panic_if(res < 0,
 				"ptrace singlestep failed!\n");
+
+		int status;
+		waitChild(m_child, &status);
+
 		writeByte(m_child, pc, 0xcc);
 	}
 
@@ -198,20 +702,140 @@ public:
 		PtraceEvent out;
 		int status;
 		int who;
-		int res;
 
 		// Assume error
 		out.type = ptrace_error;
 		out.eventId = -1;
 
-		res = ptrace(PTRACE_CONT, m_child, 0, 0);
-		if (res < 0)
+		if (!resume())
 			return out;
+		m_running.erase(m_child);
 
-		who = waitpid(m_child, &status, __WALL);
+		who = waitChild(m_child, &status);
 		if (who == -1)
 			return out;
 
+		return decodeStop(status);
+	}
+
+	bool resume()
+	{
+		m_hardwareStop = false;
+
+		if (ptrace(PTRACE_CONT, m_child, 0, 0) < 0)
+			return false;
+		m_running.insert(m_child);
+
+		return true;
+	}
+
+	int waitEvent(PtraceEvent &out)
+	{
+		out.type = ptrace_error;
+		out.eventId = -1;
+
+		while (!m_running.empty()) {
+			int status;
+			pid_t who = waitpid(-1, &status, __WALL);
+
+			if (who < 0)
+				return -1;
+
+			// Not running, e.g., the template. Kept for the next wait on it
+			if (m_running.erase(who) == 0) {
+				m_pendingStatus[who] = status;
+				continue;
+			}
+
+			if (!selectChild(who))
+				return -1;
+
+			out = decodeStop(status);
+
+			return who;
+		}
+
+		return -1;
+	}
+
+	bool selectChild(int pid)
+	{
+		std::map<pid_t, ChildState>::iterator it;
+
+		if (pid == m_child)
+			return true;
+
+		it = m_parked.find(pid);
+		if (it == m_parked.end())
+			return false;
+
+		parkChild();
+		swapChildState(it->second);
+		m_parked.erase(it);
+		m_child = pid;
+
+		return true;
+	}
+
+private:
+	// The area for the out-of-line copies and the syscall stub
+	void mapDisplacedArea()
+	{
+		void *hint = NULL;
+
+#if defined(__x86_64__)
+		/*
+		 * The jmp back from the copies is rel32, so try to place the
+		 * area within reach of the program text.
+		 */
+		hint = (void *)(((unsigned long)&IPtrace::getInstance + (1UL << 30)) &
+				~(m_pageSize - 1));
+#endif
+
+		/*
+		 * Shared, so that it's inherited by all forked children, and
+		 * copies written here are directly visible to them.
+		 */
+		m_displacedArea = (uint8_t *)mmap(hint, DISPLACED_AREA_SIZE,
+				PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (m_displacedArea == MAP_FAILED) {
+			coin_debug(PTRACE_MSG, "PT can't map displaced step area (%d), using single-step\n",
+					errno);
+			m_displacedArea = NULL;
+		}
+
+		/*
+		 * The next to last slot has "int $0x80; int3" ("syscall; int3"
+		 * on x86_64), which is used to run system calls in the fork
+		 * server template. The last one holds a SIG_IGN action.
+		 */
+		m_syscallStub = NULL;
+		m_ignoreAction = NULL;
+		if (m_displacedArea) {
+			m_syscallStub = m_displacedArea + DISPLACED_AREA_SIZE - SYSCALL_AREA_SIZE;
+#if defined(__x86_64__)
+			m_syscallStub[0] = 0x0f;
+			m_syscallStub[1] = 0x05;
+#else
+			m_syscallStub[0] = 0xcd;
+			m_syscallStub[1] = 0x80;
+#endif
+			m_syscallStub[2] = 0xcc;
+
+			m_ignoreAction = (KernelSigaction *)(m_syscallStub + DISPLACED_SLOT_SIZE);
+			memset(m_ignoreAction, 0, sizeof(*m_ignoreAction));
+			m_ignoreAction->handler = (unsigned long)SIG_IGN;
+		}
+	}
+
+	// Translate a wait status of the current child into an event
+	const PtraceEvent decodeStop(int status)
+	{
+		PtraceEvent out;
+
+		out.type = ptrace_error;
+		out.eventId = -1;
 		out.addr = getPc(m_child);
 
 		// A signal?
@@ -221,41 +845,469 @@ public:
 				out.type = ptrace_breakpoint;
 				out.eventId = -1;
 
+				// Debug register hits stop before the instruction
+				if (m_dr7 != 0 && isHardwareHit((unsigned long)out.addr + 1)) {
+					out.addr = (void *)((unsigned long)out.addr + 1);
+					m_hardwareStop = true;
+				}
+
 				// Breakpoint id
-				addrToBreakpointMap_t::iterator it = m_addrToBreakpointMap.find(out.addr);
-				if (it != m_addrToBreakpointMap.end())
-					out.eventId = it->second;
+				const BreakpointTable::Slot *slot = m_breakpoints.lookup(out.addr);
+				if (slot)
+					out.eventId = slot->id;
 
 				return out;
 			}
 			// No, deliver it directly
 			coin_debug(PTRACE_MSG, "PT signal %d at %p\n",
 					WSTOPSIG(status), out.addr);
-			ptrace(PTRACE_CONT, who, 0, WSTOPSIG(status));
+			if (ptrace(PTRACE_CONT, m_child, 0, WSTOPSIG(status)) == 0)
+				m_running.insert(m_child);
 		}
 		// Thread died?
 		if (WIFSIGNALED(status) || WIFEXITED(status)) {
-			if (who == m_child) {
-				out.type = ptrace_exit;
-				out.eventId = -1;
-				return out;
-			}
+			out.type = ptrace_exit;
+			out.eventId = -1;
+			return out;
 		}
 
 		return out;
 	}
 
+	/*
+	 * Move the state of the current child aside before another child is
+	 * made the current one. The template and a child kept for restoring
+	 * are handled separately.
+	 */
+	void parkChild()
+	{
+		if (m_child < 0 || m_child == m_template || m_childRestored)
+			return;
+
+		swapChildState(m_parked[m_child]);
+		m_child = -1;
+	}
+
+	// Wait for a child, which waitEvent() might already have reaped
+	pid_t waitChild(pid_t pid, int *status)
+	{
+		std::map<pid_t, int>::iterator it = m_pendingStatus.find(pid);
+
+		if (it == m_pendingStatus.end())
+			return waitpid(pid, status, __WALL);
 
+		*status = it->second;
+		m_pendingStatus.erase(it);
+
+		return pid;
+	}
+
+	void swapChildState(ChildState &other)
+	{
+		std::swap(m_memFd, other.memFd);
+		m_breakpoints.swap(other.breakpoints);
+		for (int dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+			std::swap(m_hardwareIds[dr], other.hardwareIds[dr]);
+			std::swap(m_hardwareAddrs[dr], other.hardwareAddrs[dr]);
+		}
+		std::swap(m_dr7, other.dr7);
+		std::swap(m_hardwareStop, other.hardwareStop);
+	}
+
+public:
 	void kill()
 	{
+		int status;
+
+		// PTRACE_KILL only works on stopped children
+		if (m_running.erase(m_child) > 0)
+			::kill(m_child, SIGKILL);
+
 		ptrace(PTRACE_KILL, m_child, 0, 0);
 		ptrace(PTRACE_DETACH, m_child, 0, 0);
+		waitChild(m_child, &status);
+
+		closeMemFile();
+		m_child = -1;
 	}
 
 private:
+	bool readFile(int pid, const char *name, std::string &out)
+	{
+		char path[64];
+		char buf[4096];
+		ssize_t n;
+		int fd;
+
+		snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		out.clear();
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			out.append(buf, n);
+		close(fd);
+
+		return n == 0;
+	}
+
+	bool clearSoftDirty(int pid)
+	{
+		char path[64];
+		bool out;
+		int fd;
+
+		snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+		fd = open(path, O_WRONLY);
+		if (fd < 0)
+			return false;
+
+		out = write(fd, "4", 1) == 1;
+		close(fd);
+
+		return out;
+	}
+
+	/*
+	 * Copy the soft-dirty pages of all private mappings in the child
+	 * back from the template.
+	 */
+	bool restoreDirtyPages(const std::string &maps)
+	{
+		size_t pos = 0;
+		bool out = true;
+		char path[64];
+		int fd;
+
+		snprintf(path, sizeof(path), "/proc/%d/pagemap", m_child);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		while (out && pos < maps.size()) {
+			size_t eol = maps.find('\n', pos);
+			std::string line = maps.substr(pos, eol - pos);
+			unsigned long start, end;
+			char perms[5];
+
+			pos = eol == std::string::npos ? maps.size() : eol + 1;
+
+			if (sscanf(line.c_str(), "%lx-%lx %4s", &start, &end, perms) != 3)
+				continue;
+
+			// Shared memory is shared with the template as well
+			if (perms[3] == 's' ||
+					line.find("[vdso]") != std::string::npos ||
+					line.find("[vvar]") != std::string::npos ||
+					line.find("[vsyscall]") != std::string::npos)
+				continue;
+
+			out = restoreDirtyRange(fd, start, end);
+		}
+		close(fd);
+
+		return out;
+	}
+
+	bool restoreDirtyRange(int pagemapFd, unsigned long start, unsigned long end)
+	{
+		uint64_t entries[PAGEMAP_BATCH];
+		unsigned long page = start;
+		unsigned long runStart = 0;
+		unsigned long runEnd = 0;
+
+		while (page < end) {
+			size_t n = std::min((end - page) / m_pageSize, (unsigned long)PAGEMAP_BATCH);
+			off64_t offs = (off64_t)(page / m_pageSize) * sizeof(uint64_t);
+
+			if (pread64(pagemapFd, entries, n * sizeof(uint64_t), offs) !=
+					(ssize_t)(n * sizeof(uint64_t)))
+				return false;
+
+			for (size_t i = 0; i < n; i++, page += m_pageSize) {
+				if (!(entries[i] & PAGEMAP_SOFT_DIRTY))
+					continue;
+
+				// Copy contiguous pages together
+				if (page != runEnd) {
+					if (!copyFromTemplate(runStart, runEnd))
+						return false;
+					runStart = page;
+				}
+				runEnd = page + m_pageSize;
+			}
+		}
+
+		return copyFromTemplate(runStart, runEnd);
+	}
+
+	bool copyFromTemplate(unsigned long start, unsigned long end)
+	{
+		size_t size = end - start;
+
+		if (size == 0)
+			return true;
+
+		m_pageBuffer.resize(size);
+		if (pread64(m_templateMemFd, &m_pageBuffer[0], size, (off64_t)start) != (ssize_t)size)
+			return false;
+
+		return pwrite64(m_memFd, &m_pageBuffer[0], size, (off64_t)start) == (ssize_t)size;
+	}
+
+	/*
+	 * Wait for a stopped process we run system calls in to trap, and
+	 * pass over the SIGCHLDs from the children it has forked.
+	 */
+	bool waitForTrap(pid_t pid, int *status)
+	{
+		while (1) {
+			if (waitpid(pid, status, __WALL) < 0 ||
+					!WIFSTOPPED(*status))
+				return false;
+
+			if (WSTOPSIG(*status) == SIGTRAP)
+				return true;
+
+			ptrace(PTRACE_CONT, pid, 0, 0);
+		}
+	}
+
+	/*
+	 * Run a system call in a stopped process through the system call
+	 * stub, and restore its registers afterwards. A child forked by the
+	 * system call is attached through PTRACE_O_TRACEFORK, and returned
+	 * in @a forked when it has stopped.
+	 */
+	bool injectSyscall(pid_t pid, long nr, long arg1, long arg2,
+			long arg3, long arg4, long *result, pid_t *forked)
+	{
+		struct user_regs_struct regs, saved;
+		int status;
+
+		if (!m_syscallStub)
+			return false;
+
+		if (forked)
+			*forked = -1;
+
+		ptrace(PTRACE_GETREGS, pid, 0, &saved);
+		regs = saved;
+		regs.REG_PC = (unsigned long)m_syscallStub;
+		regs.REG_SYSCALL = nr;
+		regs.REG_ORIG_SYSCALL = -1;
+#if defined(__x86_64__)
+		regs.rdi = arg1;
+		regs.rsi = arg2;
+		regs.rdx = arg3;
+		regs.r10 = arg4;
+#else
+		regs.ebx = arg1;
+		regs.ecx = arg2;
+		regs.edx = arg3;
+		regs.esi = arg4;
+#endif
+		ptrace(PTRACE_SETREGS, pid, 0, &regs);
+
+		// Fork events, and then the int3 after the system call
+		while (1) {
+			unsigned long child;
+
+			if (ptrace(PTRACE_CONT, pid, 0, 0) < 0 ||
+					!waitForTrap(pid, &status))
+				return false;
+
+			if (status >> 8 != (SIGTRAP | (PTRACE_EVENT_FORK << 8)))
+				break;
+
+			ptrace(PTRACE_GETEVENTMSG, pid, 0, &child);
+			if (forked)
+				*forked = child;
+		}
+
+		ptrace(PTRACE_GETREGS, pid, 0, &regs);
+		*result = regs.REG_SYSCALL;
+		ptrace(PTRACE_SETREGS, pid, 0, &saved);
+
+		// New children start with a SIGSTOP
+		if (forked && *forked > 0 &&
+				(waitpid(*forked, &status, __WALL) < 0 || !WIFSTOPPED(status))) {
+			error("Forked child hasn't stopped: %x\n", status);
+			return false;
+		}
+
+		return true;
+	}
+
+	pid_t injectFork(pid_t parent)
+	{
+		pid_t child;
+		long res;
+
+		if (!injectSyscall(parent, SYS_fork, 0, 0, 0, 0, &res, &child) || child <= 0) {
+			error("Process %d failed to fork\n", parent);
+			return -1;
+		}
+
+		return child;
+	}
+
+	void openMemFile()
+	{
+		char path[64];
+
+		closeMemFile();
+
+		snprintf(path, sizeof(path), "/proc/%d/mem", m_child);
+		m_memFd = open(path, O_RDWR);
+		if (m_memFd < 0)
+			coin_debug(PTRACE_MSG, "PT can't open %s (%d), using ptrace for text\n",
+					path, errno);
+	}
+
+	void closeMemFile()
+	{
+		if (m_memFd >= 0)
+			close(m_memFd);
+
+		m_memFd = -1;
+	}
+
+	/*
+	 * Copy the instruction at addr to the displaced step area, followed by
+	 * a jmp back to the next instruction. Instructions which change or
+	 * depend on the PC can't be moved, which is recorded so that they are
+	 * only decoded once.
+	 */
+	const BreakpointTable::Slot *createDisplacedCopy(void *addr)
+	{
+		IDisassembly::Instruction insn;
+		uint8_t *copy;
+		bool relocatable;
+		long rel = 0;
+		unsigned int expected;
+		int id;
+
+		// The last slots are for the system call stub
+		if (!m_displacedArea ||
+				(m_displaced.getIdCount() + 1) * DISPLACED_SLOT_SIZE >
+				DISPLACED_AREA_SIZE - SYSCALL_AREA_SIZE)
+			return NULL;
+
+		/*
+		 * The child is a fork of this process, so the text here is the
+		 * original one, without breakpoints. The decoder only reads the
+		 * bytes of the instruction itself.
+		 */
+		relocatable = IDisassembly::getInstance().decode(insn,
+				(uint8_t *)addr, MAX_INSN_SIZE) &&
+				!insn.isControlTransfer && !insn.isPcRelative &&
+				insn.size + 5 <= DISPLACED_SLOT_SIZE;
+
+		// IDs are handed out in order, so this is where the copy goes
+		expected = m_displaced.getIdCount();
+		copy = m_displacedArea + expected * DISPLACED_SLOT_SIZE;
+		if (relocatable) {
+			unsigned long next = (unsigned long)addr + insn.size;
+
+			// The text might be out of reach of the jmp back on x86_64
+			rel = (long)(next - ((unsigned long)copy + insn.size + 5));
+			relocatable = rel == (int32_t)rel;
+		}
+
+		// The instruction byte tells if the copy is valid
+		id = m_displaced.insert(addr, relocatable);
+		panic_if((unsigned int)id != expected,
+				"Displaced copy %d of %p not in slot %u\n", id, addr, expected);
+		if (relocatable) {
+			int32_t rel32 = rel;
+
+			memcpy(copy, addr, insn.size);
+			copy[insn.size] = 0xe9; // jmp rel32
+			memcpy(copy + insn.size + 1, &rel32, sizeof(rel32));
+		}
+
+		coin_debug(PTRACE_MSG, "PT displaced copy of %p: %s\n",
+				addr, relocatable ? "yes" : "no");
+
+		return m_displaced.lookup(addr);
+	}
+
+	void resetHardwareBreakpoints()
+	{
+		for (int dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+			m_hardwareIds[dr] = -1;
+			m_hardwareAddrs[dr] = 0;
+		}
+		m_dr7 = 0;
+		m_hardwareStop = false;
+	}
+
+	unsigned long debugRegisterOffset(int dr)
+	{
+		struct user *u = NULL;
+
+		return offsetof(struct user, u_debugreg) + dr * sizeof(u->u_debugreg[0]);
+	}
+
+	bool pokeDebugRegister(int dr, unsigned long value)
+	{
+		long res = ptrace(PTRACE_POKEUSER, m_child,
+				debugRegisterOffset(dr), value);
+
+		if (res < 0)
+			coin_debug(PTRACE_MSG, "PT can't set DR%d to 0x%08lx (%d)\n",
+					dr, value, errno);
+
+		return res >= 0;
+	}
+
+	void releaseDebugRegister(int id)
+	{
+		for (int dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+			if (m_hardwareIds[dr] != id)
+				continue;
+
+			m_dr7 &= ~(1UL << (2 * dr));
+			pokeDebugRegister(7, m_dr7);
+
+			m_hardwareIds[dr] = -1;
+			m_hardwareAddrs[dr] = 0;
+		}
+	}
+
+	bool isHardwareHit(unsigned long pc)
+	{
+		int dr;
+
+		for (dr = 0; dr < N_HW_BREAKPOINTS; dr++) {
+			if (m_hardwareIds[dr] >= 0 && m_hardwareAddrs[dr] == pc)
+				break;
+		}
+		if (dr == N_HW_BREAKPOINTS)
+			return false;
+
+		errno = 0;
+		unsigned long dr6 = ptrace(PTRACE_PEEKUSER, m_child,
+				debugRegisterOffset(6), 0);
+		bool haveDr6 = errno == 0;
+
+		// The hit bits are sticky, so clear them before the next stop
+		if (haveDr6 && (dr6 & ((1UL << N_HW_BREAKPOINTS) - 1)))
+			pokeDebugRegister(6, 0);
+
+		// Could also be an int3 at the instruction before, ask DR6
+		const BreakpointTable::Slot *slot = m_breakpoints.lookup((void *)(pc - 1));
+		if (!slot || slot->hardware)
+			return true;
+
+		return haveDr6 && (dr6 & (1UL << dr)) != 0;
+	}
+
 	void *getPcFromRegs(struct user_regs_struct *regs)
 	{
-		return (void *)(regs->eip - 1);
+		return (void *)(regs->REG_PC - 1);
 	}
 
 	void *getPc(int pid)
@@ -278,27 +1330,105 @@ private:
 		unsigned long old_data;
 		unsigned long val;
 
+		// A single write if we have the memory file
+		if (pid == m_child && m_memFd >= 0 &&
+				pwrite64(m_memFd, &byte, 1, (off64_t)(unsigned long)addr) == 1)
+			return;
+
 		old_data = ptrace(PTRACE_PEEKTEXT, pid, aligned, 0);
 		val = (old_data & ~(0xffULL << shift)) | (data << shift);
 		ptrace(PTRACE_POKETEXT, pid, aligned, val);
 	}
 
+	/*
+	 * Write a set of bytes to the child text, page by page. Each page is
+	 * read, patched locally and then written back with a single write.
+	 */
+	void writePatches(PatchList_t &patches)
+	{
+		std::vector<uint8_t> buf;
+		unsigned int i = 0;
+
+		std::sort(patches.begin(), patches.end());
+
+		while (i < patches.size()) {
+			unsigned long page = patches[i].first & ~(m_pageSize - 1);
+			unsigned long first = patches[i].first;
+			unsigned long last;
+			unsigned int end;
+
+			for (end = i; end < patches.size(); end++) {
+				if ((patches[end].first & ~(m_pageSize - 1)) != page)
+					break;
+			}
+			last = patches[end - 1].first;
+
+			buf.resize(last - first + 1);
+			if (m_memFd >= 0 &&
+					pread64(m_memFd, &buf[0], buf.size(), (off64_t)first) == (ssize_t)buf.size()) {
+				for (unsigned int j = i; j < end; j++)
+					buf[patches[j].first - first] = patches[j].second;
+
+				if (pwrite64(m_memFd, &buf[0], buf.size(), (off64_t)first) == (ssize_t)buf.size()) {
+					i = end;
+					continue;
+				}
+			}
+
+			// Fall back to one word at a time, with all the patches in it
+			while (i < end) {
+				unsigned long aligned = getAligned(patches[i].first);
+				unsigned long val;
+
+				val = ptrace(PTRACE_PEEKTEXT, m_child, aligned, 0);
+				for (; i < end && getAligned(patches[i].first) == aligned; i++) {
+					unsigned long shift = 8 * (patches[i].first - aligned);
+
+					val = (val & ~(0xffUL << shift)) |
+							((unsigned long)patches[i].second << shift);
+				}
+				ptrace(PTRACE_POKETEXT, m_child, aligned, val);
+			}
+		}
+	}
+
 	unsigned long getAligned(unsigned long addr)
 	{
 		return (addr / sizeof(unsigned long)) * sizeof(unsigned long);
 	}
 
-	typedef std::map<int, void *> breakpointToAddrMap_t;
-	typedef std::map<void *, int> addrToBreakpointMap_t;
-	typedef std::map<void *, uint8_t> instructionMap_t;
-
-	int m_breakpointId;
+	BreakpointTable m_breakpoints;
+	BreakpointTable m_templateBreakpoints;
+	std::map<pid_t, ChildState> m_parked;
+	std::set<pid_t> m_running;
+	// Wait statuses of children which weren't running, see waitEvent()
+	std::map<pid_t, int> m_pendingStatus;
+	std::map<int, BreakpointTable> m_checkpoints;
 
-	instructionMap_t m_instructionMap;
-	breakpointToAddrMap_t m_breakpointToAddrMap;
-	addrToBreakpointMap_t m_addrToBreakpointMap;
+	// Kept across children, the text is the same in all of them
+	BreakpointTable m_displaced;
+	uint8_t *m_displacedArea;
+	uint8_t *m_syscallStub;
+	KernelSigaction *m_ignoreAction;
 
 	pid_t m_child;
+	pid_t m_template;
+	bool m_templateArmed;
+	int m_templateMemFd;
+	std::string m_templateMaps;
+	bool m_childRestored;
+	std::vector<uint8_t> m_pageBuffer;
+	int m_memFd;
+	unsigned long m_pageSize;
+
+	// Use PTRACE_GETREGSET for the FP state, and the size of the XSAVE area
+	bool m_useXstate;
+	size_t m_xstateSize;
+
+	int m_hardwareIds[N_HW_BREAKPOINTS];
+	unsigned long m_hardwareAddrs[N_HW_BREAKPOINTS];
+	unsigned long m_dr7;
+	bool m_hardwareStop;
 };
 
 IPtrace &IPtrace::getInstance()
@@ -0,0 +1,359 @@
+#include <thread-base.hh>
+#include <utils.hh>
+
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <map>
+
+using namespace coincident;
+
+#define DEFAULT_STACK_SIZE (8 * 1024 * 1024)
+
+/*
+ * Stacks are reused between sessions, so that stacks allocated before a
+ * fork server template was created also exist in the children of it.
+ * They are only used by the child, so they are neither committed nor
+ * cleared here. A guard page below each stack catches overflows.
+ */
+static std::vector<uint8_t *> freeStacks;
+static size_t stackSize = DEFAULT_STACK_SIZE;
+
+static uint8_t *allocateStack()
+{
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	uint8_t *p;
+
+	if (!freeStacks.empty()) {
+		p = freeStacks.back();
+		freeStacks.pop_back();
+
+		return p;
+	}
+
+	p = (uint8_t *)mmap(NULL, stackSize + pageSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	panic_if(p == MAP_FAILED,
+			"Can't map thread stack");
+
+	mprotect(p, pageSize, PROT_NONE);
+
+	return p + pageSize;
+}
+
+static void freeStack(uint8_t *stack, size_t size)
+{
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+
+	munmap(stack - pageSize, size + pageSize);
+}
+
+/*
+ * The thread whose registers are loaded in each child. Its FP state is
+ * only saved when another thread is switched in.
+ */
+static std::map<int, ThreadBase *> liveThreads;
+
+ThreadBase::ThreadBase()
+{
+	m_stackStart = allocateStack();
+	m_stackSize = stackSize;
+	// 16-byte aligned before the call on x86_64, as the SysV ABI requires
+	m_stack = m_stackStart + m_stackSize - 8;
+
+	memset(m_frame, 0, sizeof(m_frame));
+	m_frameWords = 0;
+	m_frameWritten = false;
+
+	memset(&m_regs, 0, sizeof(m_regs));
+	memset(m_fpregs, 0, sizeof(m_fpregs));
+
+	m_blocked = false;
+	m_ownsStack = true;
+	m_regsDirty = true;
+	m_fpValid = false;
+}
+
+ThreadBase::ThreadBase(const ThreadBase &other)
+{
+	*this = other;
+	m_ownsStack = false;
+}
+
+ThreadBase::~ThreadBase()
+{
+	for (std::map<int, ThreadBase *>::iterator it = liveThreads.begin();
+			it != liveThreads.end(); it++) {
+		if (it->second == this) {
+			liveThreads.erase(it);
+			break;
+		}
+	}
+
+	if (!m_ownsStack)
+		return;
+
+	// Allocated before the stack size was changed
+	if (m_stackSize == stackSize)
+		freeStacks.push_back(m_stackStart);
+	else
+		freeStack(m_stackStart, m_stackSize);
+}
+
+/*
+ * Only the general purpose registers, the FP state stays in the child
+ * until another thread is switched in.
+ */
+void ThreadBase::saveRegisters()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+
+	ptrace.saveRegisters(&m_regs);
+	m_regsDirty = false;
+
+	// The breakpoint points to the instruction AFTER the breakpoint,
+	// except for debug register breakpoints
+	if (!ptrace.stoppedAtHardwareBreakpoint()) {
+		m_regs.REGS_PC--;
+		m_regsDirty = true;
+	}
+}
+
+void ThreadBase::saveFpRegisters()
+{
+	IPtrace::getInstance().saveFpRegisters(m_fpregs);
+	m_fpValid = true;
+}
+
+void ThreadBase::loadRegisters()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+
+	/*
+	 * The child might be forked from a template created before this
+	 * thread, so the initial stack frame is written here.
+	 */
+	if (!m_frameWritten) {
+		ptrace.writeProcessMemory(m_stack, (uint8_t *)m_frame,
+				m_frameWords * sizeof(unsigned long));
+		m_frameWritten = true;
+	}
+
+	ThreadBase *&live = liveThreads[ptrace.getCurrentChild()];
+
+	// Switched in, so swap the FP state. New threads keep the current one
+	if (live != this) {
+		if (live)
+			live->saveFpRegisters();
+		if (m_fpValid)
+			ptrace.loadFpRegisters(m_fpregs);
+
+		live = this;
+		m_regsDirty = true;
+	}
+
+	// Unchanged since the last save when the same thread continues
+	if (m_regsDirty) {
+		ptrace.loadRegisters(&m_regs);
+		m_regsDirty = false;
+	}
+}
+
+bool ThreadBase::isLive()
+{
+	std::map<int, ThreadBase *>::iterator it =
+			liveThreads.find(IPtrace::getInstance().getCurrentChild());
+
+	return it != liveThreads.end() && it->second == this;
+}
+
+void ThreadBase::stepOverBreakpoint()
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+
+	// Plain stores are done here, without resuming the child at all
+	if (emulateStore())
+		return;
+
+	void *copy = ptrace.getDisplacedCopy((void *)m_regs.REGS_PC);
+
+	// Resume at the out-of-line copy, which jumps back after the instruction
+	if (copy) {
+		m_regs.REGS_PC = (unsigned long)copy;
+		m_regsDirty = true;
+		return;
+	}
+
+	ptrace.singleStep();
+	ptrace.saveRegisters(&m_regs);
+	m_regsDirty = false;
+}
+
+void ThreadBase::setPc(void *addr)
+{
+	m_regs.REGS_PC = (unsigned long)addr;
+	m_regsDirty = true;
+}
+
+void *ThreadBase::getPc()
+{
+	return (void *)m_regs.REGS_PC;
+}
+
+void *ThreadBase::getMemoryAddress(size_t *size)
+{
+	IDisassembly::Instruction insn;
+
+	if (!IDisassembly::getInstance().decode(insn, (uint8_t *)m_regs.REGS_PC, 15))
+		return NULL;
+
+	if (insn.isAddressOnly || insn.hasSegmentPrefix)
+		return NULL;
+
+	for (int i = 0; i < 2; i++) {
+		const IDisassembly::Operand &op = insn.operands[i];
+
+		if (op.type != IDisassembly::Operand::OP_MEMORY)
+			continue;
+
+		*size = op.size;
+
+		return (void *)getEffectiveAddress(op, insn.size);
+	}
+
+	return NULL;
+}
+
+int ThreadBase::backtrace(unsigned long *buf, int maxValues)
+{
+	IPtrace &ptrace = IPtrace::getInstance();
+	unsigned long fp = m_regs.REGS_FP;
+	int n = 0;
+
+	do {
+		// Saved frame pointer followed by the return address
+		unsigned long frame[2];
+
+		if (n >= maxValues)
+			break;
+
+		if (fp < (unsigned long)m_stackStart || fp > (unsigned long)m_stack)
+			break;
+
+		if (!ptrace.readProcessMemory((uint8_t *)frame, (void *)fp, sizeof(frame)))
+			break;
+
+		buf[n] = frame[1];
+
+		fp = frame[0];
+		n++;
+	} while (fp != 0);
+
+	return n;
+}
+
+void ThreadBase::block()
+{
+	m_blocked = true;
+}
+
+bool ThreadBase::isBlocked()
+{
+	return m_blocked;
+}
+
+void ThreadBase::unBlock()
+{
+	m_blocked = false;
+}
+
+unsigned long ThreadBase::getEffectiveAddress(const IDisassembly::Operand &op,
+		size_t insnSize)
+{
+	unsigned long out = op.displacement;
+
+	// Globals are typically addressed this way on x86_64
+	if (op.pcRelative)
+		out += m_regs.REGS_PC + insnSize;
+
+	if (op.base >= 0)
+		out += getRegister(op.base);
+	if (op.index >= 0)
+		out += getRegister(op.index) * op.scale;
+
+	return out;
+}
+
+/*
+ * Perform "mov reg/imm -> [mem]" at the breakpoint in the tracer, and
+ * advance the PC past it.
+ *
+ * The child is a fork of us, so the instruction is decoded from our
+ * own (unpatched) text.
+ */
+bool ThreadBase::emulateStore()
+{
+	IDisassembly::Instruction insn;
+	unsigned long value;
+
+	if (!IDisassembly::getInstance().decode(insn, (uint8_t *)m_regs.REGS_PC, 15))
+		return false;
+
+	const IDisassembly::Operand &dst = insn.operands[0];
+	const IDisassembly::Operand &src = insn.operands[1];
+
+	// Segment overrides are typically TLS accesses through %fs or %gs
+	if (!insn.isMove || insn.hasSegmentPrefix ||
+			dst.type != IDisassembly::Operand::OP_MEMORY)
+		return false;
+
+	if (src.type == IDisassembly::Operand::OP_REGISTER)
+		value = getRegister(src.reg) >> (src.highByte ? 8 : 0);
+	else if (src.type == IDisassembly::Operand::OP_IMMEDIATE)
+		value = src.immediate;
+	else
+		return false;
+
+	// Little endian, so the low bytes are first
+	if (!IPtrace::getInstance().writeProcessMemory((void *)getEffectiveAddress(dst, insn.size),
+			(uint8_t *)&value, dst.size))
+		return false;
+
+	m_regs.REGS_PC += insn.size;
+	m_regsDirty = true;
+
+	return true;
+}
+
+void IThread::releaseThread(IThread *thread)
+{
+	delete (ThreadBase *)thread;
+}
+
+IThread *IThread::copyThread(IThread *thread)
+{
+	ThreadBase *p = (ThreadBase *)thread;
+
+	// The FP state of the running thread is only in the child
+	if (p->isLive())
+		p->saveFpRegisters();
+
+	return p->clone();
+}
+
+void IThread::setStackSize(size_t size)
+{
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+
+	size = (size + pageSize - 1) & ~(pageSize - 1);
+	if (size == 0 || size == stackSize)
+		return;
+
+	while (!freeStacks.empty()) {
+		freeStack(freeStacks.back(), stackSize);
+		freeStacks.pop_back();
+	}
+
+	stackSize = size;
+}
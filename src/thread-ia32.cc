@@ -1,8 +1,7 @@
 #include <stdint.h>
 
-#include <coincident/thread.hh>
+#include <thread-base.hh>
 #include <utils.hh>
-#include <ptrace.hh>
 
 #include <sys/user.h>
 
@@ -10,34 +9,27 @@ using namespace coincident;
 
 extern "C" void cleanupAsm(void);
 
-class Thread : public IThread
+class Thread : public ThreadBase
 {
 public:
 	Thread(void (*exitHook)(),
 			int (*fn)(void *), void *arg)
 	{
-		/* Plenty of stack */
-		size_t stack_sz = 8 * 1024 * 1024;
-		m_stackStart = (uint8_t *)xmalloc(stack_sz);
-
-		m_stack = m_stackStart + stack_sz - 8;
-
-		void **p = (void **)m_stack;
-
 		setupRegs();
 
-		p[0] = (void *)exitHook; // Return address
-		p[1] = arg;
+		// Written to the child when the thread is first started
+		m_frame[0] = (unsigned long)exitHook; // Return address
+		m_frame[1] = (unsigned long)arg;
+		m_frameWords = 2;
+
 		m_regs.esp = (long)m_stack;
 		m_regs.eip = (long)fn;
 		m_regs.ebp = 0;
-
-		m_blocked = false;
 	}
 
-	virtual ~Thread()
+	ThreadBase *clone()
 	{
-		free(m_stackStart);
+		return new Thread(*this);
 	}
 
 	unsigned long getArgument(int n)
@@ -60,69 +52,13 @@ public:
 	void setReturnValue(unsigned long value)
 	{
 		m_regs.eax = value;
-	}
-
-	void saveRegisters()
-	{
-		IPtrace &ptrace = IPtrace::getInstance();
-
-		ptrace.saveRegisters(&m_regs);
-		// The breakpoint points to the instruction AFTER the breakpoint
-		m_regs.eip--;
-
-		ptrace.saveFpRegisters(&m_fpregs);
-	}
-
-	void loadRegisters()
-	{
-		IPtrace &ptrace = IPtrace::getInstance();
-
-		ptrace.loadFpRegisters(&m_fpregs);
-		ptrace.loadRegisters(&m_regs);
-	}
-
-	void stepOverBreakpoint()
-	{
-		IPtrace &ptrace = IPtrace::getInstance();
-
-		ptrace.singleStep();
-		ptrace.saveRegisters(&m_regs);
-	}
-
-	void setPc(void *addr)
-	{
-		m_regs.eip = (unsigned long)addr;
-	}
-
-	void *getPc()
-	{
-		return (void *)m_regs.eip;
-	}
-
-	int backtrace(unsigned long *buf, int maxValues)
-	{
-		unsigned long fp = m_regs.ebp;
-		int n = 0;
-
-		do {
-			if (n >= maxValues)
-				break;
-
-			if (fp < (unsigned long)m_stackStart || fp > (unsigned long)m_stack)
-				break;
-
-			buf[n] = readProcessLong(fp + 4);
-
-			fp = readProcessLong(fp);
-			n++;
-		} while (fp != 0);
-
-		return n;
+		m_regsDirty = true;
 	}
 
 	void dumpRegs(char *buf)
 	{
 		IPtrace::getInstance().saveRegisters(&m_regs);
+		m_regsDirty = false;
 		sprintf(buf,
 				"eax 0x%08lx  ebx 0x%08lx  ecx 0x%08lx  edx 0x%08lx\n"
 				"esp 0x%08lx  ebp 0x%08lx  esi 0x%08lx  edi 0x%08lx\n"
@@ -135,39 +71,28 @@ public:
 				);
 	}
 
-	void block()
+protected:
+	unsigned long getRegister(int reg)
 	{
-		m_blocked = true;
-	}
-
-	bool isBlocked()
-	{
-		return m_blocked;
-	}
+		switch (reg) {
+		case 0: return m_regs.eax;
+		case 1: return m_regs.ecx;
+		case 2: return m_regs.edx;
+		case 3: return m_regs.ebx;
+		case 4: return m_regs.esp;
+		case 5: return m_regs.ebp;
+		case 6: return m_regs.esi;
+		case 7: return m_regs.edi;
+		default:
+			break;
+		}
 
-	void unBlock()
-	{
-		m_blocked = false;
+		return 0;
 	}
 
 private:
-	unsigned long readProcessLong(unsigned long addr)
-	{
-		IPtrace &ptrace = IPtrace::getInstance();
-		union
-		{
-			uint8_t c[sizeof(unsigned long)];
-			unsigned long v;
-		} buf;
-
-		ptrace.readProcessMemory(buf.c, (void *)addr, sizeof(unsigned long));
-
-		return buf.v;
-	}
-
 	void setupRegs()
 	{
-		memset(&m_regs, 0, sizeof(m_regs));
 		asm volatile(
 				"pushf\n"
 				"popl 0(%[reg])\n"
@@ -184,17 +109,7 @@ private:
 				: : [reg]"r"(&m_regs.xfs) : "memory" );
 		asm volatile("mov    %%gs, 0(%[reg])\n"
 				: : [reg]"r"(&m_regs.xgs) : "memory" );
-
-		memset(&m_fpregs, 0, sizeof(m_fpregs));
 	}
-
-
-	uint8_t *m_stack;
-	uint8_t *m_stackStart;
-	struct user_regs_struct m_regs;
-	struct user_fpxregs_struct m_fpregs;
-
-	bool m_blocked;
 };
 
 IThread *IThread::createThread(void (*exitHook)(),
@@ -202,9 +117,3 @@ IThread *IThread::createThread(void (*exitHook)(),
 {
 	return new Thread(exitHook, fn, arg);
 }
-
-void IThread::releaseThread(IThread *thread)
-{
-	delete (Thread *)thread;
-}
-
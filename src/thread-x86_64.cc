@@ -0,0 +1,152 @@
+#include <stdint.h>
+
+#include <thread-base.hh>
+#include <utils.hh>
+
+#include <sys/user.h>
+#include <sys/syscall.h>
+#include <asm/prctl.h>
+#include <unistd.h>
+
+using namespace coincident;
+
+extern "C" void cleanupAsm(void);
+
+class Thread : public ThreadBase
+{
+public:
+	Thread(void (*exitHook)(),
+			int (*fn)(void *), void *arg)
+	{
+		setupRegs();
+
+		// Written to the child when the thread is first started
+		m_frame[0] = (unsigned long)exitHook; // Return address
+		m_frameWords = 1;
+
+		m_regs.rsp = (unsigned long)m_stack;
+		m_regs.rip = (unsigned long)fn;
+		m_regs.rdi = (unsigned long)arg;
+		m_regs.rbp = 0;
+	}
+
+	ThreadBase *clone()
+	{
+		return new Thread(*this);
+	}
+
+	/*
+	 * The first six integer arguments are passed in registers, the rest
+	 * on the stack above the return address.
+	 */
+	unsigned long getArgument(int n)
+	{
+		uint8_t *sp = (uint8_t *)m_regs.rsp;
+		unsigned long out;
+
+		switch (n) {
+		case 0: return m_regs.rdi;
+		case 1: return m_regs.rsi;
+		case 2: return m_regs.rdx;
+		case 3: return m_regs.rcx;
+		case 4: return m_regs.r8;
+		case 5: return m_regs.r9;
+		default:
+			break;
+		}
+
+		IPtrace::getInstance().readProcessMemory((uint8_t *)&out,
+				sp + (1 + n - 6) * sizeof(unsigned long), sizeof(unsigned long));
+
+		return out;
+	}
+
+	unsigned long getReturnValue()
+	{
+		return m_regs.rax;
+	}
+
+	void setReturnValue(unsigned long value)
+	{
+		m_regs.rax = value;
+		m_regsDirty = true;
+	}
+
+	void dumpRegs(char *buf)
+	{
+		IPtrace::getInstance().saveRegisters(&m_regs);
+		m_regsDirty = false;
+		sprintf(buf,
+				"rax 0x%016llx  rbx 0x%016llx  rcx 0x%016llx  rdx 0x%016llx\n"
+				"rsp 0x%016llx  rbp 0x%016llx  rsi 0x%016llx  rdi 0x%016llx\n"
+				"r8  0x%016llx  r9  0x%016llx  r10 0x%016llx  r11 0x%016llx\n"
+				"r12 0x%016llx  r13 0x%016llx  r14 0x%016llx  r15 0x%016llx\n"
+				"rip 0x%016llx  eflags 0x%04llx  fs_base 0x%016llx\n"
+				"cs 0x%04llx  ss 0x%04llx  ds 0x%04llx  es 0x%04llx  fs 0x%04llx  gs 0x%04llx\n",
+				m_regs.rax, m_regs.rbx, m_regs.rcx, m_regs.rdx,
+				m_regs.rsp, m_regs.rbp, m_regs.rsi, m_regs.rdi,
+				m_regs.r8, m_regs.r9, m_regs.r10, m_regs.r11,
+				m_regs.r12, m_regs.r13, m_regs.r14, m_regs.r15,
+				m_regs.rip, m_regs.eflags, m_regs.fs_base,
+				m_regs.cs, m_regs.ss, m_regs.ds, m_regs.es, m_regs.fs, m_regs.gs
+				);
+	}
+
+protected:
+	unsigned long getRegister(int reg)
+	{
+		switch (reg) {
+		case 0: return m_regs.rax;
+		case 1: return m_regs.rcx;
+		case 2: return m_regs.rdx;
+		case 3: return m_regs.rbx;
+		case 4: return m_regs.rsp;
+		case 5: return m_regs.rbp;
+		case 6: return m_regs.rsi;
+		case 7: return m_regs.rdi;
+		case 8: return m_regs.r8;
+		case 9: return m_regs.r9;
+		case 10: return m_regs.r10;
+		case 11: return m_regs.r11;
+		case 12: return m_regs.r12;
+		case 13: return m_regs.r13;
+		case 14: return m_regs.r14;
+		case 15: return m_regs.r15;
+		default:
+			break;
+		}
+
+		return 0;
+	}
+
+private:
+	void setupRegs()
+	{
+		asm volatile(
+				"pushfq\n"
+				"popq 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.eflags) : "memory" );
+		asm volatile("mov    %%cs, 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.cs) : "memory" );
+		asm volatile("mov    %%ds, 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.ds) : "memory" );
+		asm volatile("mov    %%ss, 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.ss) : "memory" );
+		asm volatile("mov    %%es, 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.es) : "memory" );
+		asm volatile("mov    %%fs, 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.fs) : "memory" );
+		asm volatile("mov    %%gs, 0(%[reg])\n"
+				: : [reg]"r"(&m_regs.gs) : "memory" );
+
+		// The TLS base is not in %fs on x86_64, and the stack protector needs it
+		syscall(SYS_arch_prctl, ARCH_GET_FS, &m_regs.fs_base);
+		syscall(SYS_arch_prctl, ARCH_GET_GS, &m_regs.gs_base);
+	}
+};
+
+IThread *IThread::createThread(void (*exitHook)(),
+				int (*fn)(void *), void *arg)
+{
+	return new Thread(exitHook, fn, arg);
+}
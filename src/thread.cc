@@ -5,37 +5,64 @@
 
 using namespace coincident;
 
-#define N_THREADS 16
-static IThread *threads[N_THREADS];
+#include <vector>
 
-IThread &ThreadFactory::createThread(void (*exitHook)(),
-		int (*fn)(void *), void *arg)
+// Running threads, and the free slots in the table
+static std::vector<IThread *> threads;
+static std::vector<unsigned int> freeSlots;
+
+IThread &ThreadFactory::addThread(IThread *thread)
 {
-	int i;
+	unsigned int slot;
 
-	for (i = 0; i < N_THREADS; i++) {
-		if (!threads[i])
-			break;
+	if (freeSlots.empty()) {
+		slot = threads.size();
+		threads.push_back(NULL);
+	} else {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
 	}
-	if (i == N_THREADS)
-		panic("No free threads!");
 
-	threads[i] = IThread::createThread(exitHook, fn, arg);
+	threads[slot] = thread;
+	thread->m_factorySlot = slot;
 
-	return *threads[i];
+	return *thread;
+}
+
+IThread &ThreadFactory::createThread(void (*exitHook)(),
+		int (*fn)(void *), void *arg)
+{
+	return addThread(IThread::createThread(exitHook, fn, arg));
 }
 
 void ThreadFactory::releaseThread(IThread &thread)
 {
-	int i;
-
-	for (i = 0; i < N_THREADS; i++) {
-		if (threads[i] == &thread) {
-			IThread::releaseThread(threads[i]);
-			threads[i] = NULL;
-			return;
-		}
-	}
+	unsigned int slot = thread.m_factorySlot;
+
+	panic_if(slot >= threads.size() || threads[slot] != &thread,
+			"No such thread???");
+
+	IThread::releaseThread(threads[slot]);
+	threads[slot] = NULL;
+	freeSlots.push_back(slot);
+}
+
+IThread *ThreadFactory::copyThread(IThread &thread)
+{
+	return IThread::copyThread(&thread);
+}
 
-	panic("No such thread???");
+void ThreadFactory::releaseCopy(IThread *copy)
+{
+	IThread::releaseThread(copy);
+}
+
+void ThreadFactory::setStackSize(size_t size)
+{
+	IThread::setStackSize(size);
+}
+
+IThread &ThreadFactory::restoreThread(IThread &copy)
+{
+	return addThread(IThread::copyThread(&copy));
 }
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "mock-thread.hh"
+
+#include <detector.hh>
+#include <string.h>
+
+// Threads and access sites for the detector tests
+class DetectorFixture
+{
+public:
+	DetectorFixture() :
+		thread0(NULL, NULL, NULL), thread1(NULL, NULL, NULL), thread2(NULL, NULL, NULL),
+		site0((void *)0x1000), site1((void *)0x2000), site2((void *)0x3000)
+	{
+		setCaller(thread0, 0x8000);
+		setCaller(thread1, 0x9000);
+		setCaller(thread2, 0xa000);
+	}
+
+	MockThread thread0;
+	MockThread thread1;
+	MockThread thread2;
+
+	void *site0;
+	void *site1;
+	void *site2;
+
+private:
+	// A one-frame backtrace
+	static void setCaller(MockThread &thread, unsigned long caller)
+	{
+		ON_CALL(thread, backtrace(_, _))
+			.WillByDefault(DoAll(SetArgPointee<0>(caller), Return(1)));
+		EXPECT_CALL(thread, backtrace(_, _))
+			.Times(AnyNumber());
+	}
+};
@@ -12,16 +12,34 @@ public:
 
 	MOCK_METHOD3(readMemory, bool(uint8_t *dst, void *start, size_t bytes));
 	MOCK_METHOD3(readProcessMemory, bool(uint8_t *dst, void *start, size_t bytes));
+	MOCK_METHOD3(writeProcessMemory, bool(void *dst, const uint8_t *src, size_t bytes));
 
 	MOCK_METHOD1(setBreakpoint, int(void *addr));
+	MOCK_METHOD3(setBreakpoints, bool(void **addrs, int *ids, int n));
 	MOCK_METHOD1(clearBreakpoint, bool(int id));
 	MOCK_METHOD0(clearAllBreakpoints, void());
+	MOCK_METHOD1(setHardwareBreakpoint, bool(int id));
+	MOCK_METHOD1(clearHardwareBreakpoint, bool(int id));
+	MOCK_METHOD0(stoppedAtHardwareBreakpoint, bool());
+	MOCK_METHOD1(getDisplacedCopy, void *(void *addr));
+	MOCK_METHOD0(remapDisplacedArea, void());
 	MOCK_METHOD0(forkAndAttach, int());
+	MOCK_METHOD0(forkTemplate, int());
+	MOCK_METHOD0(forkFromTemplate, int());
+	MOCK_METHOD0(killTemplate, void());
+	MOCK_METHOD0(restoreChild, bool());
+	MOCK_METHOD0(checkpoint, int());
+	MOCK_METHOD1(forkFromCheckpoint, int(int checkpoint));
+	MOCK_METHOD1(releaseCheckpoint, void(int checkpoint));
 	MOCK_METHOD1(loadRegisters, void(void *regs));
 	MOCK_METHOD1(saveRegisters, void(void *regs));
 	MOCK_METHOD1(loadFpRegisters, void(void *regs));
 	MOCK_METHOD1(saveFpRegisters, void(void *regs));
+	MOCK_METHOD0(getCurrentChild, int());
 	MOCK_METHOD0(singleStep, void());
 	MOCK_METHOD0(continueExecution, const PtraceEvent());
+	MOCK_METHOD0(resume, bool());
+	MOCK_METHOD1(waitEvent, int(PtraceEvent &out));
+	MOCK_METHOD1(selectChild, bool(int pid));
 	MOCK_METHOD0(kill, void());
 };
@@ -1,82 +1,25 @@
-#include "test.hh"
+#include "mock-thread.hh"
 
-#include <coincident/thread.hh>
-
-using namespace coincident;
-
-class FakeThread
+IThread *IThread::createThread(void (*exitHook)(),
+				int (*fn)(void *), void *arg)
 {
-public:
-	FakeThread() : m_blocked(false)
-	{
-	}
-
-	void myBlock()
-	{
-		m_blocked = true;
-	}
-
-	void myUnBlock()
-	{
-		m_blocked = false;
-	}
-
-	bool isBlocked()
-	{
-		return m_blocked;
-	}
-
-	bool m_blocked;
-};
-
-class Thread : public IThread {
-public:
-	Thread(void (*exitHook)(),
-			int (*fn)(void *), void *arg)
-	{
-		ON_CALL(*this, isBlocked())
-			.WillByDefault(Invoke(&m_fake, &FakeThread::isBlocked));
-		ON_CALL(*this, block())
-			.WillByDefault(Invoke(&m_fake, &FakeThread::myBlock));
-		ON_CALL(*this, unBlock())
-			.WillByDefault(Invoke(&m_fake, &FakeThread::myUnBlock));
-
-		EXPECT_CALL(*this, stepOverBreakpoint())
-				.Times(AnyNumber());
-		EXPECT_CALL(*this, isBlocked())
-			.Times(AnyNumber());
-		EXPECT_CALL(*this, block())
-			.Times(AnyNumber());
-		EXPECT_CALL(*this, unBlock())
-			.Times(AnyNumber());
-	}
+	return new MockThread(exitHook, fn, arg);
+}
 
-	MOCK_METHOD0(stepOverBreakpoint, void());
-	MOCK_METHOD0(saveRegisters, void());
-	MOCK_METHOD0(loadRegisters, void());
-	MOCK_METHOD1(setPc, void(void *));
-	MOCK_METHOD0(getPc, void *());
-	MOCK_METHOD1(getArgument,unsigned long(int n));
-	MOCK_METHOD0(getReturnValue, unsigned long());
-	MOCK_METHOD1(setReturnValue, void(unsigned long value));
-	MOCK_METHOD2(backtrace, int(unsigned long *buf, int maxValues));
-	MOCK_METHOD1(dumpRegs, void(char *buf));
+void IThread::releaseThread(IThread *thread)
+{
+	delete (MockThread *)thread;
+}
 
-	MOCK_METHOD0(block, void());
-	MOCK_METHOD0(unBlock, void());
-	MOCK_METHOD0(isBlocked, bool());
+IThread *IThread::copyThread(IThread *thread)
+{
+	MockThread *out = new MockThread(NULL, NULL, NULL);
 
-	uint8_t m_regs[8];
-	FakeThread m_fake;
-};
+	out->m_fake = ((MockThread *)thread)->m_fake;
 
-IThread *IThread::createThread(void (*exitHook)(),
-				int (*fn)(void *), void *arg)
-{
-	return new Thread(exitHook, fn, arg);
+	return out;
 }
 
-void IThread::releaseThread(IThread *thread)
+void IThread::setStackSize(size_t size)
 {
-	delete (Thread *)thread;
 }
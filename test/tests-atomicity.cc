@@ -0,0 +1,49 @@
+#include "test.hh"
+#include "detector-fixture.hh"
+
+TEST(atomicityUnserializable, DetectorFixture)
+{
+	IDetector *av = IDetector::createAtomicity();
+	unsigned long data;
+
+	// Read-modify-write, with a remote write in between
+	ASSERT_FALSE(av->onAccess(&thread0, site0, &data, sizeof(data), false));
+	ASSERT_FALSE(av->wantsPreemption());
+	ASSERT_FALSE(av->onAccess(&thread1, site2, &data, sizeof(data), true));
+	ASSERT_TRUE(av->wantsPreemption());
+	ASSERT_TRUE(av->onAccess(&thread0, site1, &data, sizeof(data), true));
+	ASSERT_TRUE(strstr(av->getReport(),
+			"read at 0x1000 and write at 0x2000 (thread 0) are interleaved by write at 0x3000 (thread 1)") != NULL);
+
+	// The pair is consumed
+	ASSERT_FALSE(av->onAccess(&thread0, site1, &data, sizeof(data), true));
+
+	av->reset();
+	ASSERT_FALSE(av->onAccess(&thread0, site0, &data, sizeof(data), false));
+	ASSERT_FALSE(av->wantsPreemption());
+
+	delete av;
+}
+
+TEST(atomicitySerializable, DetectorFixture)
+{
+	IDetector *av = IDetector::createAtomicity();
+	unsigned long data[3];
+
+	// W R R: same as the remote read before or after the pair
+	ASSERT_FALSE(av->onAccess(&thread0, site0, &data[0], sizeof(data[0]), true));
+	ASSERT_FALSE(av->onAccess(&thread1, site2, &data[0], sizeof(data[0]), false));
+	ASSERT_FALSE(av->onAccess(&thread0, site1, &data[0], sizeof(data[0]), false));
+
+	// W W W: the remote write is simply overwritten
+	ASSERT_FALSE(av->onAccess(&thread0, site0, &data[1], sizeof(data[1]), true));
+	ASSERT_FALSE(av->onAccess(&thread1, site2, &data[1], sizeof(data[1]), true));
+	ASSERT_FALSE(av->onAccess(&thread0, site1, &data[1], sizeof(data[1]), true));
+
+	// W R W: the remote read sees the intermediate value
+	ASSERT_FALSE(av->onAccess(&thread0, site0, &data[2], sizeof(data[2]), true));
+	ASSERT_FALSE(av->onAccess(&thread1, site2, &data[2], sizeof(data[2]), false));
+	ASSERT_TRUE(av->onAccess(&thread0, site1, &data[2], sizeof(data[2]), true));
+
+	delete av;
+}
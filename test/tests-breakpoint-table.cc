@@ -0,0 +1,131 @@
+#include "test.hh"
+
+#include <breakpoint-table.hh>
+#include <sys/time.h>
+
+#include <map>
+#include <vector>
+
+using namespace coincident;
+
+static uint64_t timeStampUs(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_usec + tv.tv_sec * 1000 * 1000;
+}
+
+// Something which looks like store sites in a text segment
+static std::vector<void *> makeSites(unsigned int n)
+{
+	std::vector<void *> out;
+	unsigned long addr = 0x08048000;
+
+	for (unsigned int i = 0; i < n; i++) {
+		addr += 2 + rand() % 12;
+		out.push_back((void *)addr);
+	}
+
+	return out;
+}
+
+TEST(breakpointTableInsertLookupErase)
+{
+	BreakpointTable table;
+	std::vector<void *> sites = makeSites(1000);
+
+	ASSERT_TRUE(table.lookup(sites[0]) == NULL);
+	ASSERT_TRUE(table.getAddress(0) == NULL);
+
+	for (unsigned int i = 0; i < sites.size(); i++) {
+		int id = table.insert(sites[i], i & 0xff);
+
+		ASSERT_TRUE(id == (int)i);
+	}
+	ASSERT_TRUE(table.size() == sites.size());
+
+	for (unsigned int i = 0; i < sites.size(); i++) {
+		const BreakpointTable::Slot *slot = table.lookup(sites[i]);
+
+		ASSERT_TRUE(slot);
+		ASSERT_TRUE(slot->id == (int)i);
+		ASSERT_TRUE(slot->instruction == (i & 0xff));
+		ASSERT_TRUE(table.getAddress(i) == sites[i]);
+	}
+
+	// Remove every other breakpoint, the rest should still be found
+	for (unsigned int i = 0; i < sites.size(); i += 2)
+		ASSERT_TRUE(table.erase(i) == true);
+	ASSERT_TRUE(table.erase(0) == false);
+	ASSERT_TRUE(table.size() == sites.size() / 2);
+
+	for (unsigned int i = 0; i < sites.size(); i++) {
+		const BreakpointTable::Slot *slot = table.lookup(sites[i]);
+
+		if (i % 2 == 0) {
+			ASSERT_TRUE(slot == NULL);
+			ASSERT_TRUE(table.getAddress(i) == NULL);
+		} else {
+			ASSERT_TRUE(slot);
+			ASSERT_TRUE(slot->id == (int)i);
+		}
+	}
+
+	// IDs are not reused until the table is cleared
+	ASSERT_TRUE(table.insert(sites[0], 0) == (int)sites.size());
+
+	table.clear();
+	ASSERT_TRUE(table.size() == 0);
+	ASSERT_TRUE(table.lookup(sites[1]) == NULL);
+	ASSERT_TRUE(table.insert(sites[1], 0) == 0);
+}
+
+/*
+ * Lookup cost per trap: continueExecution maps the trap address to an
+ * ID, and singleStep looks up the original instruction. The std::map
+ * numbers are for the three maps Ptrace used before.
+ */
+TEST(breakpointTableLookupBenchmark, DEADLINE_REALTIME_MS(60000))
+{
+	unsigned int counts[] = {1000, 10000, 100000};
+	const unsigned int nTraps = 1000000;
+
+	for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		std::vector<void *> sites = makeSites(counts[c]);
+		std::map<void *, int> addrToId;
+		std::map<void *, uint8_t> instructions;
+		BreakpointTable table;
+		std::vector<void *> traps;
+		unsigned long sum = 0;
+		uint64_t start, tableUs, mapUs;
+
+		for (unsigned int i = 0; i < sites.size(); i++) {
+			table.insert(sites[i], 0x55);
+			addrToId[sites[i]] = i;
+			instructions[sites[i]] = 0x55;
+		}
+		for (unsigned int i = 0; i < nTraps; i++)
+			traps.push_back(sites[rand() % sites.size()]);
+
+		start = timeStampUs();
+		for (unsigned int i = 0; i < nTraps; i++) {
+			sum += table.lookup(traps[i])->id;
+			sum += table.lookup(traps[i])->instruction;
+		}
+		tableUs = timeStampUs() - start;
+
+		start = timeStampUs();
+		for (unsigned int i = 0; i < nTraps; i++) {
+			sum += addrToId.find(traps[i])->second;
+			sum += instructions.find(traps[i])->second;
+		}
+		mapUs = timeStampUs() - start;
+
+		printf("%6u sites: table %6.1f ns/trap, std::map %6.1f ns/trap (%lu)\n",
+				counts[c],
+				tableUs * 1000.0 / nTraps, mapUs * 1000.0 / nTraps,
+				sum & 1);
+	}
+}
@@ -101,6 +101,7 @@ TEST(controllerTestThreadRemoval, DEADLINE_REALTIME_MS(10000))
 	ASSERT_EQ(controller.m_nThreads, 2);
 
 	Session cur(controller, controller.m_nThreads, controller.m_threads);
+	controller.m_curSession = &cur;
 	ASSERT_EQ(cur.m_nThreads, 2);
 
 	// Will remove thread since it exited
@@ -162,7 +163,7 @@ TEST(controllerThreadScheduling, DEADLINE_REALTIME_MS(10000))
 	IThread *curThread = controller.getCurrentThread();
 	ASSERT_TRUE(curThread == cur.m_threads[cur.m_curThread]);
 
-	curThread->block();
+	controller.blockThread(curThread);
 	ASSERT_TRUE(curThread->isBlocked() == true);
 	IThread *blockedThread = curThread;
 
@@ -175,7 +176,7 @@ TEST(controllerThreadScheduling, DEADLINE_REALTIME_MS(10000))
 	ASSERT_EQ(cur.m_curThread, 0);
 
 	// Should no longer be blocked
-	blockedThread->unBlock();
+	controller.unBlockThread(blockedThread);
 	ASSERT_TRUE(blockedThread->isBlocked() == false);
 
 	EXPECT_CALL(selector, selectThread(_,_,2,_,_))
@@ -261,3 +262,439 @@ TEST(semaphores, DEADLINE_REALTIME_MS(10000))
 	// Should have reached the max value (no reschedule)
 	sem.signal();
 }
+
+TEST(controllerCheckpointEviction, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	MockPtrace &ptrace = (MockPtrace &)IPtrace::getInstance();
+
+	EXPECT_CALL(ptrace, releaseCheckpoint(200))
+		.Times(1);
+	EXPECT_CALL(ptrace, releaseCheckpoint(202))
+		.Times(1);
+
+	controller.setCheckpoints(2);
+	ASSERT_TRUE(controller.nextCheckpoint() == NULL);
+
+	for (int pid = 200; pid < 203; pid++) {
+		Controller::Checkpoint *cp = new Controller::Checkpoint();
+
+		cp->pid = pid;
+		cp->tried.resize(2, false);
+		cp->tried[0] = true;
+		controller.addCheckpoint(cp);
+	}
+	// The least recently used is evicted
+	ASSERT_EQ(controller.m_checkpoints.size(), 2U);
+
+	Controller::Checkpoint *next = controller.nextCheckpoint();
+	ASSERT_TRUE(next != NULL);
+	ASSERT_EQ(next->pid, 202);
+
+	// Explored checkpoints are released
+	next->tried[1] = true;
+	next = controller.nextCheckpoint();
+	ASSERT_TRUE(next != NULL);
+	ASSERT_EQ(next->pid, 201);
+	ASSERT_EQ(controller.m_checkpoints.size(), 1U);
+}
+
+TEST(controllerConcurrentSessions, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	MockPtrace &ptrace = (MockPtrace &)IPtrace::getInstance();
+
+	PtraceEvent ev;
+
+	ev.type = ptrace_exit;
+	ev.eventId = -1;
+	ev.addr = NULL;
+
+	// Both children are started before the first event is handled
+	EXPECT_CALL(ptrace, forkAndAttach())
+		.Times(Exactly(2))
+		.WillOnce(Return(100))
+		.WillOnce(Return(101));
+	EXPECT_CALL(ptrace, resume())
+		.Times(Exactly(2))
+		.WillRepeatedly(Return(true));
+	EXPECT_CALL(ptrace, waitEvent(_))
+		.Times(Exactly(1))
+		.WillOnce(DoAll(SetArgReferee<0>(ev), Return(101)));
+
+	// The other one is stopped when the first run fails
+	EXPECT_CALL(ptrace, selectChild(100))
+		.Times(Exactly(1))
+		.WillOnce(Return(true));
+	EXPECT_CALL(ptrace, kill())
+		.Times(Exactly(2));
+
+	controller.addThread(test_thread, NULL);
+	controller.addThread(test_thread, NULL);
+
+	controller.setRuns(4);
+	controller.setConcurrentSessions(2);
+	ASSERT_FALSE(controller.run());
+	ASSERT_TRUE(controller.m_curSession == NULL);
+	ASSERT_EQ(controller.m_liveSessions, 0);
+}
+
+TEST(controllerPipeline, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	MockPtrace &ptrace = (MockPtrace &)IPtrace::getInstance();
+
+	PtraceEvent ev;
+
+	ev.type = ptrace_exit;
+	ev.eventId = -1;
+	ev.addr = NULL;
+
+	// The second child is forked while the first one runs
+	EXPECT_CALL(ptrace, forkAndAttach())
+		.Times(Exactly(2))
+		.WillOnce(Return(100))
+		.WillOnce(Return(101));
+	EXPECT_CALL(ptrace, resume())
+		.Times(Exactly(1))
+		.WillOnce(Return(true));
+	EXPECT_CALL(ptrace, waitEvent(_))
+		.Times(Exactly(1))
+		.WillOnce(DoAll(SetArgReferee<0>(ev), Return(100)));
+	EXPECT_CALL(ptrace, selectChild(_))
+		.WillRepeatedly(Return(true));
+
+	// The first run fails, and the prepared child is killed
+	EXPECT_CALL(ptrace, kill())
+		.Times(Exactly(2));
+
+	controller.addThread(test_thread, NULL);
+	controller.addThread(test_thread, NULL);
+
+	controller.setRuns(4);
+	controller.setPipeline(true);
+	ASSERT_FALSE(controller.run());
+	ASSERT_TRUE(controller.m_curSession == NULL);
+	ASSERT_EQ(controller.m_liveSessions, 0);
+}
+
+/*
+ * Cost of a thread switch against the number of threads, with every
+ * fourth thread blocked. Beyond the old limit of 16 threads.
+ */
+TEST(controllerSwitchBenchmark, DEADLINE_REALTIME_MS(60000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	unsigned int counts[] = {4, 16, 64, 256};
+	const unsigned int nSwitches = 10000;
+	PtraceEvent ev;
+
+	ev.type = ptrace_breakpoint;
+	ev.eventId = 0;
+	ev.addr = NULL;
+
+	for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		uint64_t start, us;
+
+		while (controller.m_nThreads < (int)counts[c])
+			controller.addThread(test_thread, NULL);
+
+		Session cur(controller, controller.m_nThreads, controller.m_threads);
+		controller.m_curSession = &cur;
+		ASSERT_EQ(cur.m_nThreads, (int)counts[c]);
+
+		for (unsigned int i = 0; i < counts[c]; i += 4)
+			controller.blockThread(cur.m_threads[i]);
+
+		start = controller.getTimeStamp(0);
+		for (unsigned int i = 0; i < nSwitches; i++) {
+			cur.switchThread(ev);
+			ASSERT_FALSE(cur.m_threads[cur.m_curThread]->isBlocked());
+		}
+		us = controller.getTimeStamp(start);
+
+		printf("%4u threads: %8.1f ns/switch\n",
+				counts[c], us * 1000.0 / nSwitches);
+		controller.m_curSession = NULL;
+	}
+}
+
+TEST(controllerRunnableBitmap, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	MockPtrace &ptrace = (MockPtrace &)IPtrace::getInstance();
+
+	EXPECT_CALL(ptrace, singleStep())
+		.Times(AnyNumber());
+
+	// More than one word
+	for (int i = 0; i < 70; i++)
+		controller.addThread(test_thread, NULL);
+
+	Session cur(controller, controller.m_nThreads, controller.m_threads);
+	controller.m_curSession = &cur;
+	ASSERT_EQ(cur.m_nRunnable, 70);
+
+	controller.blockThread(cur.m_threads[3]);
+	controller.blockThread(cur.m_threads[69]);
+	controller.blockThread(cur.m_threads[69]);
+	ASSERT_EQ(cur.m_nRunnable, 68);
+	ASSERT_FALSE(cur.isRunnable(3));
+	ASSERT_FALSE(cur.isRunnable(69));
+
+	// The last thread takes the place of the removed one
+	IThread *last = cur.m_threads[69];
+
+	cur.removeThread(0, 3);
+	ASSERT_EQ(cur.m_nThreads, 69);
+	ASSERT_EQ(cur.m_nRunnable, 68);
+	ASSERT_TRUE(cur.m_threads[3] == last);
+	ASSERT_FALSE(cur.isRunnable(3));
+
+	controller.unBlockThread(last);
+	ASSERT_EQ(cur.m_nRunnable, 69);
+	ASSERT_TRUE(cur.isRunnable(3));
+
+	// The default selector only picks runnable threads
+	controller.blockThread(cur.m_threads[10]);
+	for (int i = 0; i < 1000; i++) {
+		PtraceEvent ev;
+
+		ev.type = ptrace_breakpoint;
+		ev.eventId = 0;
+		ev.addr = NULL;
+		cur.switchThread(ev);
+		ASSERT_TRUE(cur.m_curThread != 10);
+	}
+	controller.m_curSession = NULL;
+}
+
+TEST(controllerStorePruning, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	Controller::SiteSharingMap_t sites;
+	void *privateSite = (void *)0x1000;
+	void *sharedSite = (void *)0x2000;
+
+	controller.setStorePruning(2);
+	controller.m_breakpoints[privateSite] = 1;
+	controller.m_breakpoints[sharedSite] = 1;
+
+	sites[privateSite] = false;
+	sites[sharedSite] = false;
+	controller.m_breakpointsChanged = false;
+	controller.updateStoreProfile(sites);
+	ASSERT_FALSE(controller.isPruned(privateSite));
+	ASSERT_FALSE(controller.m_breakpointsChanged);
+
+	// Once shared, a site is never pruned
+	sites[sharedSite] = true;
+	controller.updateStoreProfile(sites);
+	ASSERT_TRUE(controller.isPruned(privateSite));
+	ASSERT_FALSE(controller.isPruned(sharedSite));
+	ASSERT_TRUE(controller.m_breakpointsChanged);
+	ASSERT_TRUE(controller.m_breakpoints.find(privateSite) == controller.m_breakpoints.end());
+	ASSERT_TRUE(controller.m_breakpoints.find(sharedSite) != controller.m_breakpoints.end());
+
+	sites[sharedSite] = false;
+	for (int i = 0; i < 4; i++)
+		controller.updateStoreProfile(sites);
+	ASSERT_FALSE(controller.isPruned(sharedSite));
+
+	// Stores which can't be decoded (the mock threads return NULL) are shared
+	controller.addThread(test_thread, NULL);
+	controller.addThread(test_thread, NULL);
+
+	Session cur(controller, controller.m_nThreads, controller.m_threads);
+	void *unknownSite = (void *)0x3000;
+
+	cur.profileAccess(unknownSite, NULL, 0, true);
+	ASSERT_TRUE(cur.m_siteShared[unknownSite]);
+
+	// Written by one thread and read by another is shared
+	void *flagStore = (void *)0x4000;
+	void *flagLoad = (void *)0x5000;
+	void *constLoad = (void *)0x6000;
+	unsigned long flag, constant;
+
+	cur.m_curThread = 0;
+	cur.profileAccess(flagStore, &flag, sizeof(flag), true);
+	cur.profileAccess(constLoad, &constant, sizeof(constant), false);
+	ASSERT_FALSE(cur.m_siteShared[flagStore]);
+	cur.m_curThread = 1;
+	cur.profileAccess(flagLoad, &flag, sizeof(flag), false);
+	cur.profileAccess(constLoad, &constant, sizeof(constant), false);
+	ASSERT_TRUE(cur.m_siteShared[flagStore]);
+	ASSERT_TRUE(cur.m_siteShared[flagLoad]);
+	// Only read by both
+	ASSERT_FALSE(cur.m_siteShared[constLoad]);
+}
+
+TEST(controllerRaceFuzzer, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	RaceFuzzerSelector *selector = new RaceFuzzerSelector(1);
+	void *siteA = (void *)0x1000;
+	void *siteB = (void *)0x2000;
+	unsigned long word, other;
+	PtraceEvent ev;
+
+	ev.type = ptrace_breakpoint;
+	ev.eventId = 0;
+	ev.addr = NULL;
+
+	controller.setThreadSelector(selector);
+	controller.addThread(test_thread, NULL);
+	controller.addThread(test_thread, NULL);
+
+	Session cur(controller, controller.m_nThreads, controller.m_threads);
+	IThread *t0 = cur.m_threads[0];
+	IThread *t1 = cur.m_threads[1];
+
+	controller.m_curSession = &cur;
+
+	// Collect the pair
+	selector->onRunStart(&cur.m_threads[0], 2);
+	ASSERT_FALSE(selector->onAccess(t0, siteA, &word, sizeof(word), true));
+	ASSERT_FALSE(selector->onAccess(t1, siteB, &word, sizeof(word), false));
+
+	// The parked thread goes first
+	selector->onRunStart(&cur.m_threads[0], 2);
+	ASSERT_TRUE(selector->onAccess(t0, siteA, &word, sizeof(word), true));
+	ASSERT_FALSE(cur.isRunnable(0));
+	ASSERT_FALSE(selector->onAccess(t1, siteB, &other, sizeof(other), false));
+	ASSERT_TRUE(selector->onAccess(t1, siteB, &word, sizeof(word), false));
+	ASSERT_TRUE(cur.isRunnable(0));
+	cur.m_curThread = 1;
+	cur.switchThread(ev);
+	ASSERT_EQ(cur.m_curThread, 0);
+	// ... and both pass when they trap again
+	ASSERT_FALSE(selector->onAccess(t0, siteA, &word, sizeof(word), true));
+	ASSERT_FALSE(selector->onAccess(t1, siteB, &word, sizeof(word), false));
+
+	// The arriving thread goes first, then the parked one
+	selector->onRunStart(&cur.m_threads[0], 2);
+	ASSERT_TRUE(selector->onAccess(t0, siteA, &word, sizeof(word), true));
+	ASSERT_FALSE(selector->onAccess(t1, siteB, &word, sizeof(word), false));
+	ASSERT_TRUE(cur.isRunnable(0));
+	cur.m_curThread = 1;
+	cur.switchThread(ev);
+	ASSERT_EQ(cur.m_curThread, 0);
+
+	// A parked thread is let go when nothing else can run
+	ASSERT_FALSE(selector->onAccess(t0, siteA, &word, sizeof(word), true));
+	ASSERT_TRUE(selector->onAccess(t0, siteA, &word, sizeof(word), true));
+	controller.blockThread(t1);
+	cur.switchThread(ev);
+	ASSERT_EQ(cur.m_curThread, 0);
+	ASSERT_TRUE(cur.isRunnable(0));
+
+	controller.m_curSession = NULL;
+
+	// The runs can't overlap
+	controller.setPipeline(true);
+	ASSERT_FALSE(controller.run());
+	controller.setPipeline(false);
+
+	controller.setThreadSelector(new DefaultThreadSelector());
+}
+
+TEST(controllerPctSelector, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	PctSelector *selector = new PctSelector(2);
+	PtraceEvent ev;
+
+	ev.type = ptrace_breakpoint;
+	ev.eventId = 0;
+	ev.addr = NULL;
+
+	controller.setThreadSelector(selector);
+	for (int i = 0; i < 3; i++)
+		controller.addThread(test_thread, NULL);
+
+	Session cur(controller, controller.m_nThreads, controller.m_threads);
+
+	controller.m_curSession = &cur;
+
+	// The first run has 100 events, which is the estimate for the second
+	selector->onRunStart(&cur.m_threads[0], 3);
+	cur.m_curThread = selector->selectThread(0, &cur.m_threads[0], 3, 0, NULL);
+	for (int i = 0; i < 100; i++)
+		cur.switchThread(ev);
+
+	// Exactly one priority change in the second run
+	selector->onRunStart(&cur.m_threads[0], 3);
+	int first = selector->selectThread(0, &cur.m_threads[0], 3, 0, NULL);
+	int last = first;
+	int changes = 0;
+
+	cur.m_curThread = first;
+	for (int i = 0; i < 100; i++) {
+		cur.switchThread(ev);
+		if (cur.m_curThread != last)
+			changes++;
+		last = cur.m_curThread;
+	}
+	ASSERT_EQ(changes, 1);
+
+	// The highest priority runnable thread runs
+	controller.blockThread(cur.m_threads[last]);
+	cur.switchThread(ev);
+	ASSERT_TRUE(cur.m_curThread != last);
+
+	int next = cur.m_curThread;
+
+	for (int i = 0; i < 10; i++) {
+		cur.switchThread(ev);
+		ASSERT_EQ(cur.m_curThread, next);
+	}
+	controller.unBlockThread(cur.m_threads[last]);
+	cur.switchThread(ev);
+	ASSERT_EQ(cur.m_curThread, last);
+
+	controller.m_curSession = NULL;
+	controller.setThreadSelector(new DefaultThreadSelector());
+}
+
+TEST(controllerPctChangePoints, DEADLINE_REALTIME_MS(10000))
+{
+	Controller &controller = (Controller &)IController::getInstance();
+	PctSelector *selector = new PctSelector(3);
+	PtraceEvent ev;
+
+	ev.type = ptrace_breakpoint;
+	ev.eventId = 0;
+	ev.addr = NULL;
+
+	controller.setThreadSelector(selector);
+	for (int i = 0; i < 3; i++)
+		controller.addThread(test_thread, NULL);
+
+	Session cur(controller, controller.m_nThreads, controller.m_threads);
+
+	controller.m_curSession = &cur;
+
+	// Two events, so both change points must be drawn without collisions
+	for (int run = 0; run < 20; run++) {
+		selector->onRunStart(&cur.m_threads[0], 3);
+		cur.m_curThread = selector->selectThread(0, &cur.m_threads[0], 3, 0, NULL);
+
+		int last = cur.m_curThread;
+		int changes = 0;
+
+		for (int i = 0; i < 2; i++) {
+			cur.switchThread(ev);
+			if (cur.m_curThread != last)
+				changes++;
+			last = cur.m_curThread;
+		}
+
+		// The first run has no estimate yet
+		if (run > 0)
+			ASSERT_EQ(changes, 2);
+	}
+
+	controller.m_curSession = NULL;
+	controller.setThreadSelector(new DefaultThreadSelector());
+}
@@ -15,16 +15,21 @@ public:
 	void clear()
 	{
 		m_memRefs = 0;
+		m_stackRefs = 0;
 		m_calls = 0;
 		m_branches = 0;
 	}
 
-	void onMemoryReference(off_t offset, bool isLoad)
+	void onMemoryReference(off_t offset, bool isLoad, bool isStackLocal)
 	{
 		bool off_ok = offset == 2 || offset == 8 || offset == 13 || offset == 21;
 
 		ASSERT_TRUE(off_ok);
+		// (%esp) and -0x34(%ebp)
+		ASSERT_TRUE(isStackLocal == (offset == 2 || offset == 13));
 		m_memRefs++;
+		if (isStackLocal)
+			m_stackRefs++;
 	}
 
 	void onCall(off_t offset)
@@ -41,6 +46,7 @@ public:
 
 
 	int m_memRefs;
+	int m_stackRefs;
 	int m_calls;
 	int m_branches;
 };
@@ -77,6 +83,7 @@ TEST(disassembly)
 	res = dis.execute(&harness, asm_dump, sizeof(asm_dump));
 	ASSERT_TRUE(res == true);
 	ASSERT_TRUE(harness.m_memRefs == 4);
+	ASSERT_TRUE(harness.m_stackRefs == 2);
 	ASSERT_TRUE(harness.m_calls == 1);
 	ASSERT_TRUE(harness.m_branches == 1);
 
@@ -88,3 +95,118 @@ TEST(disassembly)
 	ASSERT_TRUE(harness.m_calls == 1);
 	ASSERT_TRUE(harness.m_branches == 1);
 }
+
+TEST(disassemblyDecode)
+{
+	IDisassembly &dis = IDisassembly::getInstance();
+	IDisassembly::Instruction insn;
+	bool res;
+
+	res = dis.decode(insn, NULL, 0);
+	ASSERT_TRUE(res == false);
+
+	// jbe
+	res = dis.decode(insn, asm_dump, sizeof(asm_dump));
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 2);
+	ASSERT_TRUE(insn.isControlTransfer == true);
+	ASSERT_TRUE(insn.isPcRelative == true);
+
+	// mov %ebx,(%esp)
+	res = dis.decode(insn, asm_dump + 2, sizeof(asm_dump) - 2);
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 3);
+	ASSERT_TRUE(insn.isControlTransfer == false);
+	ASSERT_TRUE(insn.isPcRelative == false);
+	ASSERT_TRUE(insn.isMove == true);
+	ASSERT_TRUE(insn.operands[0].type == IDisassembly::Operand::OP_MEMORY);
+	ASSERT_TRUE(insn.operands[0].size == 4);
+	ASSERT_TRUE(insn.operands[0].base == 4);
+	ASSERT_TRUE(insn.operands[0].index == -1);
+	ASSERT_TRUE(insn.operands[0].displacement == 0);
+	ASSERT_TRUE(insn.operands[1].type == IDisassembly::Operand::OP_REGISTER);
+	ASSERT_TRUE(insn.operands[1].reg == 3);
+
+	// mov %dl,-0x34(%ebp)
+	res = dis.decode(insn, asm_dump + 13, sizeof(asm_dump) - 13);
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 3);
+	ASSERT_TRUE(insn.isMove == true);
+	ASSERT_TRUE(insn.operands[0].type == IDisassembly::Operand::OP_MEMORY);
+	ASSERT_TRUE(insn.operands[0].size == 1);
+	ASSERT_TRUE(insn.operands[0].base == 5);
+	ASSERT_TRUE(insn.operands[0].displacement == -0x34);
+	ASSERT_TRUE(insn.operands[1].type == IDisassembly::Operand::OP_REGISTER);
+	ASSERT_TRUE(insn.operands[1].reg == 2);
+	ASSERT_TRUE(insn.operands[1].highByte == false);
+
+	// call
+	res = dis.decode(insn, asm_dump + 16, sizeof(asm_dump) - 16);
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 5);
+	ASSERT_TRUE(insn.isControlTransfer == true);
+
+	// Truncated mov 0x258(%ebx),%eax
+	res = dis.decode(insn, asm_dump + 21, 3);
+	ASSERT_TRUE(res == false);
+}
+
+#if defined(__x86_64__)
+static uint8_t asm_dump64[] =
+{
+		0x48, 0xc7, 0x40, 0x08, 0xff, 0xff, 0xff, 0xff, // 0 movq   $0xffffffffffffffff,0x8(%rax)
+		0x4c, 0x89, 0x4c, 0x24, 0x10, //                   8 mov    %r9,0x10(%rsp)
+		0x41, 0x88, 0x34, 0x9f, //                        13 mov    %sil,(%r15,%rbx,4)
+		0x48, 0x89, 0x05, 0x00, 0x01, 0x00, 0x00, //      17 mov    %rax,0x100(%rip)
+};
+
+TEST(disassemblyDecode64)
+{
+	IDisassembly &dis = IDisassembly::getInstance();
+	IDisassembly::Instruction insn;
+	bool res;
+
+	// The immediate is sign-extended to the store size
+	res = dis.decode(insn, asm_dump64, sizeof(asm_dump64));
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 8);
+	ASSERT_TRUE(insn.isMove == true);
+	ASSERT_TRUE(insn.operands[0].type == IDisassembly::Operand::OP_MEMORY);
+	ASSERT_TRUE(insn.operands[0].size == 8);
+	ASSERT_TRUE(insn.operands[0].base == 0);
+	ASSERT_TRUE(insn.operands[0].displacement == 8);
+	ASSERT_TRUE(insn.operands[1].type == IDisassembly::Operand::OP_IMMEDIATE);
+	ASSERT_TRUE(insn.operands[1].immediate == ~0UL);
+
+	// mov %r9,0x10(%rsp)
+	res = dis.decode(insn, asm_dump64 + 8, sizeof(asm_dump64) - 8);
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 5);
+	ASSERT_TRUE(insn.operands[0].base == 4);
+	ASSERT_TRUE(insn.operands[0].displacement == 0x10);
+	ASSERT_TRUE(insn.operands[1].type == IDisassembly::Operand::OP_REGISTER);
+	ASSERT_TRUE(insn.operands[1].reg == 9);
+	ASSERT_TRUE(insn.operands[1].size == 8);
+
+	// mov %sil,(%r15,%rbx,4)
+	res = dis.decode(insn, asm_dump64 + 13, sizeof(asm_dump64) - 13);
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 4);
+	ASSERT_TRUE(insn.operands[0].size == 1);
+	ASSERT_TRUE(insn.operands[0].base == 15);
+	ASSERT_TRUE(insn.operands[0].index == 3);
+	ASSERT_TRUE(insn.operands[0].scale == 4);
+	ASSERT_TRUE(insn.operands[1].reg == 6);
+	ASSERT_TRUE(insn.operands[1].highByte == false);
+
+	// RIP-relative, can't be moved
+	res = dis.decode(insn, asm_dump64 + 17, sizeof(asm_dump64) - 17);
+	ASSERT_TRUE(res == true);
+	ASSERT_TRUE(insn.size == 7);
+	ASSERT_TRUE(insn.isPcRelative == true);
+	ASSERT_TRUE(insn.operands[0].type == IDisassembly::Operand::OP_MEMORY);
+	ASSERT_TRUE(insn.operands[0].pcRelative == true);
+	ASSERT_TRUE(insn.operands[0].base == -1);
+	ASSERT_TRUE(insn.operands[0].displacement == 0x100);
+}
+#endif
@@ -22,8 +22,11 @@ public:
 			m_map[std::string(fn.getName())]++;
 
 			IFunction::ReferenceList_t list = fn.getMemoryStores();
-			if (strcmp(fn.getName(), "mockReadMemory") == 0)
+			IFunction::ReferenceList_t stackList = fn.getStackMemoryStores();
+			if (strcmp(fn.getName(), "mockReadMemory") == 0) {
 				ASSERT_TRUE(list.size() > 0);
+				ASSERT_TRUE(stackList.size() > 0);
+			}
 		}
 
 		std::map<std::string, int> m_map;
@@ -39,6 +42,7 @@ static uint8_t asm_dump[] =
 		0x88, 0x55, 0xcc, //                   mov    %dl,-0x34(%ebp)
 		0xe8, 0x88, 0xe3, 0xff, 0xff, //       call   8048ef0 <inp_next>
 		0x8b, 0x83, 0x58, 0x02, 0x00, 0x00, // mov    0x258(%ebx),%eax
+		0x89, 0x83, 0x58, 0x02, 0x00, 0x00, // mov    %eax,0x258(%ebx)
 };
 
 
@@ -46,7 +50,8 @@ extern "C" bool mockReadMemory(uint8_t *dst, void *start, size_t bytes)
 {
 	size_t to_cpy = bytes;
 
-	if (to_cpy < sizeof(asm_dump))
+	// Not past the function, which might be smaller
+	if (to_cpy > sizeof(asm_dump))
 		to_cpy = sizeof(asm_dump);
 
 	memcpy(dst, asm_dump, to_cpy);
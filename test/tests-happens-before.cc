@@ -0,0 +1,68 @@
+#include "test.hh"
+#include "detector-fixture.hh"
+
+static int lock;
+
+TEST(happensBeforeUnordered, DetectorFixture)
+{
+	IDetector *hb = IDetector::createHappensBefore();
+	int data;
+
+	ASSERT_FALSE(hb->onAccess(&thread0, site0, &data, sizeof(data), true));
+	// Same thread, ordered
+	ASSERT_FALSE(hb->onAccess(&thread0, site1, &data, sizeof(data), false));
+
+	ASSERT_TRUE(hb->onAccess(&thread1, site1, &data, sizeof(data), true));
+	ASSERT_TRUE(strstr(hb->getReport(), "write at 0x1000") != NULL);
+
+	// Tracked per word, so another byte of the same word conflicts too
+	hb->reset();
+	ASSERT_FALSE(hb->onAccess(&thread0, site0, &data, 1, true));
+	ASSERT_TRUE(hb->onAccess(&thread1, site1, (uint8_t *)&data + 1, 1, true));
+
+	delete hb;
+}
+
+TEST(happensBeforeLockOrdered, DetectorFixture)
+{
+	IDetector *hb = IDetector::createHappensBefore();
+	int data;
+
+	hb->onAcquire(&thread0, &lock);
+	ASSERT_FALSE(hb->onAccess(&thread0, site0, &data, sizeof(data), true));
+	hb->onRelease(&thread0, &lock);
+
+	hb->onAcquire(&thread1, &lock);
+	ASSERT_FALSE(hb->onAccess(&thread1, site1, &data, sizeof(data), false));
+	ASSERT_FALSE(hb->onAccess(&thread1, site1, &data, sizeof(data), true));
+	hb->onRelease(&thread1, &lock);
+
+	// Not ordered after thread 1's release
+	ASSERT_TRUE(hb->onAccess(&thread2, site2, &data, sizeof(data), false));
+	ASSERT_TRUE(strstr(hb->getReport(), "read at 0x3000") != NULL);
+
+	delete hb;
+}
+
+TEST(happensBeforeSharedReads, DetectorFixture)
+{
+	IDetector *hb = IDetector::createHappensBefore();
+	int data;
+
+	ASSERT_FALSE(hb->onAccess(&thread0, site0, &data, sizeof(data), true));
+	hb->onRelease(&thread0, &lock);
+	hb->onAcquire(&thread1, &lock);
+	hb->onAcquire(&thread2, &lock);
+
+	// Concurrent reads are fine
+	ASSERT_FALSE(hb->onAccess(&thread1, site1, &data, sizeof(data), false));
+	ASSERT_FALSE(hb->onAccess(&thread2, site2, &data, sizeof(data), false));
+
+	// ... but not a write which is unordered with one of them
+	hb->onRelease(&thread1, &lock);
+	hb->onAcquire(&thread0, &lock);
+	ASSERT_TRUE(hb->onAccess(&thread0, site0, &data, sizeof(data), true));
+	ASSERT_TRUE(strstr(hb->getReport(), "read at 0x3000") != NULL);
+
+	delete hb;
+}
@@ -0,0 +1,62 @@
+#include "test.hh"
+#include "detector-fixture.hh"
+
+static int lock0;
+static int lock1;
+
+TEST(locksetUnprotected, DetectorFixture)
+{
+	IDetector *ls = IDetector::createLockset();
+	unsigned long data[2];
+
+	// Exclusive to one thread
+	ASSERT_FALSE(ls->onAccess(&thread0, site0, &data[0], sizeof(data[0]), true));
+	ASSERT_FALSE(ls->onAccess(&thread0, site0, &data[0], sizeof(data[0]), false));
+
+	// Read-shared is fine without locks
+	ASSERT_FALSE(ls->onAccess(&thread1, site1, &data[0], sizeof(data[0]), false));
+
+	ASSERT_TRUE(ls->onAccess(&thread1, site1, &data[0], sizeof(data[0]), true));
+	ASSERT_TRUE(strstr(ls->getReport(), "read at 0x1000 (thread 0, backtrace 0x00008000)") != NULL);
+	ASSERT_TRUE(strstr(ls->getReport(), "write at 0x2000 (thread 1, backtrace 0x00009000)") != NULL);
+
+	// Only reported once
+	ASSERT_FALSE(ls->onAccess(&thread0, site0, &data[0], sizeof(data[0]), true));
+
+	// Another word
+	ASSERT_FALSE(ls->onAccess(&thread0, site0, &data[1], sizeof(data[1]), true));
+	ASSERT_TRUE(ls->onAccess(&thread1, site1, &data[1], sizeof(data[1]), true));
+	ASSERT_TRUE(strstr(ls->getReport(), "write at 0x1000 (thread 0, backtrace 0x00008000)") != NULL);
+
+	delete ls;
+}
+
+TEST(locksetProtected, DetectorFixture)
+{
+	IDetector *ls = IDetector::createLockset();
+	unsigned long data;
+
+	ls->onLock(&thread0, &lock0);
+	ls->onLock(&thread0, &lock1);
+	ASSERT_FALSE(ls->onAccess(&thread0, site0, &data, sizeof(data), true));
+	ls->onUnlock(&thread0, &lock1);
+	ls->onUnlock(&thread0, &lock0);
+
+	ls->onLock(&thread1, &lock0);
+	ls->onLock(&thread1, &lock1);
+	ASSERT_FALSE(ls->onAccess(&thread1, site1, &data, sizeof(data), true));
+	ls->onUnlock(&thread1, &lock1);
+
+	// lock0 is still common
+	ASSERT_FALSE(ls->onAccess(&thread1, site1, &data, sizeof(data), true));
+	ls->onUnlock(&thread1, &lock0);
+
+	ls->onLock(&thread0, &lock1);
+	ASSERT_TRUE(ls->onAccess(&thread0, site0, &data, sizeof(data), false));
+
+	// Nothing left after a reset
+	ls->reset();
+	ASSERT_FALSE(ls->onAccess(&thread1, site1, &data, sizeof(data), true));
+
+	delete ls;
+}